@@ -0,0 +1,710 @@
+/*
+ *  broker.c
+ *  iusbcomm
+ *
+ *  Created by John Heaton on 5/16/10.
+ *  Copyright 2010 Gojohnnyboi. All rights reserved.
+ *
+ */
+
+#include "broker.h"
+#include "helper.h"
+
+#include <fcntl.h>
+#include <limits.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/un.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+
+enum iUSBBrokerMessage {
+	kBrokerListDevices = 1,
+	kBrokerSendCommand = 2,
+	kBrokerReadResponse = 3,
+	kBrokerSendFile = 4,
+	kBrokerAllocate = 5,
+	kBrokerSendBuffer = 6
+};
+
+struct __iUSBBrokerRequest {
+	uint32_t type;
+	uint32_t length;
+	uint64_t ecid;
+	uint32_t arg[2];
+};
+
+struct __iUSBBrokerReply {
+	int32_t status;
+	uint32_t length;
+};
+
+struct __iUSBBrokerConnection {
+	iUSBBrokerRef broker;
+	int socket;
+	void *shared;
+	size_t sharedLength;
+	struct __iUSBBrokerConnection *next;
+};
+
+struct __iUSBBroker {
+	char socketPath[sizeof(((struct sockaddr_un *)0)->sun_path)];
+	int listenSocket;
+	CFSocketRef acceptSocket;
+	CFRunLoopSourceRef acceptSource;
+	pthread_mutex_t lock;
+	pthread_cond_t connectionClosed;
+	Boolean stopping;
+	CFMutableArrayRef devices;
+	iUSBUploadSchedulerRef scheduler;
+	struct __iUSBBrokerConnection *connections;
+};
+
+struct __iUSBBrokerClient {
+	int socket;
+	pthread_mutex_t lock;
+};
+
+HIDDEN int brokerSocketCreate(const char *path, struct sockaddr_un *address);
+HIDDEN Boolean brokerSend(int socket, const void *header, size_t headerLength, const void *payload, size_t payloadLength, int passedDescriptor);
+HIDDEN Boolean brokerReceive(int socket, void *header, size_t headerLength, int *passedDescriptor);
+HIDDEN Boolean brokerReceiveAll(int socket, void *buf, size_t length);
+HIDDEN void brokerAccept(CFSocketRef s, CFSocketCallBackType type, CFDataRef address, const void *data, void *info);
+HIDDEN void *brokerServe(void *connection);
+HIDDEN void brokerHandleRequest(iUSBBrokerRef broker, struct __iUSBBrokerConnection *connection, struct __iUSBBrokerRequest *request, char *payload, int passedDescriptor);
+HIDDEN iUSBRecoveryDeviceRef brokerCopyDevice(iUSBBrokerRef broker, uint64_t ecid);
+HIDDEN int brokerCreateShared(struct __iUSBBrokerConnection *connection, size_t length);
+HIDDEN void brokerReleaseShared(struct __iUSBBrokerConnection *connection);
+HIDDEN Boolean clientRequest(iUSBBrokerClientRef client, struct __iUSBBrokerRequest *request, const void *payload, int passedDescriptor, struct __iUSBBrokerReply *reply, void **replyPayload, int *replyDescriptor);
+
+iUSBBrokerRef iUSBBrokerCreate(CFStringRef socketPath) {
+	if(socketPath == NULL)
+		return NULL;
+	
+	iUSBBrokerRef newBroker = calloc(1, sizeof(struct __iUSBBroker));
+	if(!CFStringGetFileSystemRepresentation(socketPath, newBroker->socketPath, sizeof(newBroker->socketPath))) {
+		free(newBroker);
+		return NULL;
+	}
+	
+	struct sockaddr_un address;
+	newBroker->listenSocket = brokerSocketCreate(newBroker->socketPath, &address);
+	if(newBroker->listenSocket < 0) {
+		free(newBroker);
+		return NULL;
+	}
+	
+	// only the owner may connect; nobody can before listen, so there's no window after bind
+	unlink(newBroker->socketPath);
+	if(bind(newBroker->listenSocket, (struct sockaddr *)&address, sizeof(address)) != 0 || chmod(newBroker->socketPath, 0600) != 0 || listen(newBroker->listenSocket, 16) != 0) {
+		close(newBroker->listenSocket);
+		free(newBroker);
+		return NULL;
+	}
+	
+	pthread_mutex_init(&newBroker->lock, NULL);
+	pthread_cond_init(&newBroker->connectionClosed, NULL);
+	newBroker->devices = CFArrayCreateMutable(kCFAllocatorDefault, 0, NULL);
+	
+	return newBroker;
+}
+
+Boolean iUSBBrokerStartOnRunLoop(iUSBBrokerRef broker, CFRunLoopRef runLoop, CFStringRef runLoopMode) {
+	if(broker == NULL || broker->acceptSocket != NULL)
+		return 0;
+	
+	CFSocketContext context = { 0, broker, NULL, NULL, NULL };
+	broker->acceptSocket = CFSocketCreateWithNative(kCFAllocatorDefault, broker->listenSocket, kCFSocketAcceptCallBack, brokerAccept, &context);
+	if(broker->acceptSocket == NULL)
+		return 0;
+	
+	// the broker closes the descriptor itself
+	CFSocketSetSocketFlags(broker->acceptSocket, CFSocketGetSocketFlags(broker->acceptSocket) & ~kCFSocketCloseOnInvalidate);
+	
+	broker->acceptSource = CFSocketCreateRunLoopSource(kCFAllocatorDefault, broker->acceptSocket, 0);
+	CFRunLoopAddSource((runLoop ? runLoop : CFRunLoopGetCurrent()), broker->acceptSource, (runLoopMode ? runLoopMode : kCFRunLoopDefaultMode));
+	
+	return 1;
+}
+
+void iUSBBrokerSetUploadScheduler(iUSBBrokerRef broker, iUSBUploadSchedulerRef scheduler) {
+	if(broker == NULL)
+		return;
+	
+	pthread_mutex_lock(&broker->lock);
+	broker->scheduler = scheduler;
+	pthread_mutex_unlock(&broker->lock);
+}
+
+void iUSBBrokerHandleConnectionChange(iUSBBrokerRef broker, iUSBRecoveryDeviceRef device, uint8_t newConnectionState) {
+	if(broker == NULL || device == NULL)
+		return;
+	
+	pthread_mutex_lock(&broker->lock);
+	CFIndex index = CFArrayGetFirstIndexOfValue(broker->devices, CFRangeMake(0, CFArrayGetCount(broker->devices)), device);
+	
+	if(newConnectionState == kUSBConnected && index == kCFNotFound) {
+		CFArrayAppendValue(broker->devices, iUSBRecoveryDeviceRetain(device));
+	} else if(newConnectionState == kUSBDisconnected && index != kCFNotFound) {
+		CFArrayRemoveValueAtIndex(broker->devices, index);
+		iUSBRecoveryDeviceRelease(device);
+	}
+	pthread_mutex_unlock(&broker->lock);
+}
+
+void iUSBBrokerRelease(iUSBBrokerRef broker) {
+	if(broker != NULL) {
+		if(broker->acceptSource != NULL) {
+			CFRunLoopSourceInvalidate(broker->acceptSource);
+			CFRelease(broker->acceptSource);
+		}
+		if(broker->acceptSocket != NULL) {
+			CFSocketInvalidate(broker->acceptSocket);
+			CFRelease(broker->acceptSocket);
+		}
+		close(broker->listenSocket);
+		unlink(broker->socketPath);
+		
+		// wake every serving thread out of its read, then wait for them to let go of the broker
+		pthread_mutex_lock(&broker->lock);
+		broker->stopping = 1;
+		struct __iUSBBrokerConnection *connection;
+		for(connection = broker->connections; connection != NULL; connection = connection->next) {
+			shutdown(connection->socket, SHUT_RDWR);
+		}
+		while(broker->connections != NULL) {
+			pthread_cond_wait(&broker->connectionClosed, &broker->lock);
+		}
+		pthread_mutex_unlock(&broker->lock);
+		
+		CFIndex i;
+		for(i = 0; i < CFArrayGetCount(broker->devices); ++i) {
+			iUSBRecoveryDeviceRelease((iUSBRecoveryDeviceRef)CFArrayGetValueAtIndex(broker->devices, i));
+		}
+		CFRelease(broker->devices);
+		
+		pthread_mutex_destroy(&broker->lock);
+		pthread_cond_destroy(&broker->connectionClosed);
+		
+		free(broker);
+	}
+}
+
+iUSBBrokerClientRef iUSBBrokerClientCreate(CFStringRef socketPath) {
+	if(socketPath == NULL)
+		return NULL;
+	
+	char path[sizeof(((struct sockaddr_un *)0)->sun_path)];
+	if(!CFStringGetFileSystemRepresentation(socketPath, path, sizeof(path)))
+		return NULL;
+	
+	struct sockaddr_un address;
+	int clientSocket = brokerSocketCreate(path, &address);
+	if(clientSocket < 0)
+		return NULL;
+	
+	if(connect(clientSocket, (struct sockaddr *)&address, sizeof(address)) != 0) {
+		close(clientSocket);
+		return NULL;
+	}
+	
+	iUSBBrokerClientRef newClient = calloc(1, sizeof(struct __iUSBBrokerClient));
+	newClient->socket = clientSocket;
+	
+	pthread_mutexattr_t attributes;
+	pthread_mutexattr_init(&attributes);
+	pthread_mutexattr_settype(&attributes, PTHREAD_MUTEX_RECURSIVE);
+	pthread_mutex_init(&newClient->lock, &attributes);
+	pthread_mutexattr_destroy(&attributes);
+	
+	return newClient;
+}
+
+CFIndex iUSBBrokerClientCopyDevices(iUSBBrokerClientRef client, iUSBBrokerDevice **devices) {
+	if(client == NULL || devices == NULL)
+		return -1;
+	
+	*devices = NULL;
+	
+	struct __iUSBBrokerRequest request = { kBrokerListDevices, 0, 0, { 0, 0 } };
+	struct __iUSBBrokerReply reply;
+	if(!clientRequest(client, &request, NULL, -1, &reply, (void **)devices, NULL) || reply.status < 0) {
+		free(*devices);
+		*devices = NULL;
+		return -1;
+	}
+	
+	return reply.length / sizeof(iUSBBrokerDevice);
+}
+
+Boolean iUSBBrokerClientSendCommand(iUSBBrokerClientRef client, uint64_t ecid, CFStringRef command) {
+	if(client == NULL || command == NULL)
+		return 0;
+	
+	char commandBuf[0x400];
+	if(!CFStringGetCString(command, commandBuf, sizeof(commandBuf), kCFStringEncodingUTF8))
+		return 0;
+	
+	struct __iUSBBrokerRequest request = { kBrokerSendCommand, strlen(commandBuf) + 1, ecid, { 0, 0 } };
+	struct __iUSBBrokerReply reply;
+	if(!clientRequest(client, &request, commandBuf, -1, &reply, NULL, NULL))
+		return 0;
+	
+	return (reply.status > 0 ? 1 : 0);
+}
+
+CFStringRef iUSBBrokerClientReadResponse(iUSBBrokerClientRef client, uint64_t ecid, UInt32 noDataTimeout, UInt32 completionTimeout) {
+	if(client == NULL)
+		return NULL;
+	
+	struct __iUSBBrokerRequest request = { kBrokerReadResponse, 0, ecid, { noDataTimeout, completionTimeout } };
+	struct __iUSBBrokerReply reply;
+	char *responseBuf = NULL;
+	if(!clientRequest(client, &request, NULL, -1, &reply, (void **)&responseBuf, NULL) || reply.status <= 0 || responseBuf == NULL) {
+		free(responseBuf);
+		return NULL;
+	}
+	
+	CFStringRef response = CFStringCreateWithBytes(kCFAllocatorDefault, (const UInt8 *)responseBuf, reply.length, kCFStringEncodingUTF8, 0);
+	free(responseBuf);
+	
+	return response;
+}
+
+Boolean iUSBBrokerClientSendData(iUSBBrokerClientRef client, uint64_t ecid, CFDataRef data) {
+	if(client == NULL || data == NULL || CFDataGetLength(data) == 0)
+		return 0;
+	
+	size_t length = CFDataGetLength(data);
+	if(length > UINT32_MAX)
+		return 0;
+	
+	// both requests go out under the client's lock, so another thread's upload can't take the buffer in between
+	pthread_mutex_lock(&client->lock);
+	
+	struct __iUSBBrokerRequest request = { kBrokerAllocate, (uint32_t)length, ecid, { 0, 0 } };
+	struct __iUSBBrokerReply reply;
+	int descriptor = -1;
+	Boolean retVal = 0;
+	
+	// the broker's own shared memory is filled in place, and the broker sends straight from it
+	if(clientRequest(client, &request, NULL, -1, &reply, NULL, &descriptor) && reply.status > 0 && descriptor >= 0) {
+		void *shared = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_SHARED, descriptor, 0);
+		if(shared != MAP_FAILED) {
+			memcpy(shared, CFDataGetBytePtr(data), length);
+			munmap(shared, length);
+			
+			request.type = kBrokerSendBuffer;
+			retVal = (clientRequest(client, &request, NULL, -1, &reply, NULL, NULL) && reply.status > 0 ? 1 : 0);
+		}
+	}
+	
+	if(descriptor >= 0) close(descriptor);
+	pthread_mutex_unlock(&client->lock);
+	
+	return retVal;
+}
+
+Boolean iUSBBrokerClientSendFile(iUSBBrokerClientRef client, uint64_t ecid, CFStringRef filePath) {
+	if(client == NULL || filePath == NULL)
+		return 0;
+	
+	char path[PATH_MAX];
+	if(!CFStringGetFileSystemRepresentation(filePath, path, sizeof(path)))
+		return 0;
+	
+	int descriptor = open(path, O_RDONLY);
+	if(descriptor < 0)
+		return 0;
+	
+	struct __iUSBBrokerRequest request = { kBrokerSendFile, 0, ecid, { 0, 0 } };
+	struct __iUSBBrokerReply reply;
+	Boolean retVal = (clientRequest(client, &request, NULL, descriptor, &reply, NULL, NULL) && reply.status > 0 ? 1 : 0);
+	close(descriptor);
+	
+	return retVal;
+}
+
+void iUSBBrokerClientRelease(iUSBBrokerClientRef client) {
+	if(client != NULL) {
+		close(client->socket);
+		pthread_mutex_destroy(&client->lock);
+		
+		free(client);
+	}
+}
+
+HIDDEN int brokerSocketCreate(const char *path, struct sockaddr_un *address) {
+	if(strlen(path) >= sizeof(address->sun_path))
+		return -1;
+	
+	memset(address, 0, sizeof(struct sockaddr_un));
+	address->sun_family = AF_UNIX;
+	strcpy(address->sun_path, path);
+	
+	int newSocket = socket(AF_UNIX, SOCK_STREAM, 0);
+	if(newSocket < 0)
+		return -1;
+	
+	// a peer that goes away mid-reply should fail the write, not kill the process
+	int on = 1;
+	setsockopt(newSocket, SOL_SOCKET, SO_NOSIGPIPE, &on, sizeof(on));
+	
+	return newSocket;
+}
+
+HIDDEN Boolean brokerSend(int socket, const void *header, size_t headerLength, const void *payload, size_t payloadLength, int passedDescriptor) {
+	struct iovec iov[2];
+	iov[0].iov_base = (void *)header;
+	iov[0].iov_len = headerLength;
+	iov[1].iov_base = (void *)payload;
+	iov[1].iov_len = payloadLength;
+	
+	union {
+		struct cmsghdr header;
+		char space[CMSG_SPACE(sizeof(int))];
+	} control;
+	
+	struct msghdr message;
+	memset(&message, 0, sizeof(message));
+	message.msg_iov = iov;
+	message.msg_iovlen = (payloadLength ? 2 : 1);
+	
+	if(passedDescriptor >= 0) {
+		message.msg_control = &control;
+		message.msg_controllen = sizeof(control);
+		
+		struct cmsghdr *cmsg = CMSG_FIRSTHDR(&message);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+		memcpy(CMSG_DATA(cmsg), &passedDescriptor, sizeof(int));
+	}
+	
+	ssize_t sent = sendmsg(socket, &message, 0);
+	if(sent < 0)
+		return 0;
+	
+	// the descriptor went with the first byte; whatever the kernel didn't take goes out plainly
+	size_t total = headerLength + payloadLength;
+	while((size_t)sent < total) {
+		const char *rest = (sent < headerLength ? (const char *)header + sent : (const char *)payload + (sent - headerLength));
+		size_t restLength = (sent < headerLength ? headerLength - sent : total - sent);
+		ssize_t written = write(socket, rest, restLength);
+		if(written <= 0)
+			return 0;
+		sent += written;
+	}
+	
+	return 1;
+}
+
+HIDDEN Boolean brokerReceive(int socket, void *header, size_t headerLength, int *passedDescriptor) {
+	struct iovec iov;
+	iov.iov_base = header;
+	iov.iov_len = headerLength;
+	
+	union {
+		struct cmsghdr header;
+		char space[CMSG_SPACE(sizeof(int))];
+	} control;
+	
+	struct msghdr message;
+	memset(&message, 0, sizeof(message));
+	message.msg_iov = &iov;
+	message.msg_iovlen = 1;
+	message.msg_control = &control;
+	message.msg_controllen = sizeof(control);
+	
+	ssize_t received = recvmsg(socket, &message, 0);
+	if(received <= 0)
+		return 0;
+	
+	*passedDescriptor = -1;
+	struct cmsghdr *cmsg = CMSG_FIRSTHDR(&message);
+	if(cmsg != NULL && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+		memcpy(passedDescriptor, CMSG_DATA(cmsg), sizeof(int));
+	}
+	
+	if(!brokerReceiveAll(socket, (char *)header + received, headerLength - received)) {
+		if(*passedDescriptor >= 0) close(*passedDescriptor);
+		return 0;
+	}
+	
+	return 1;
+}
+
+HIDDEN Boolean brokerReceiveAll(int socket, void *buf, size_t length) {
+	while(length > 0) {
+		ssize_t received = read(socket, buf, length);
+		if(received <= 0)
+			return 0;
+		
+		buf = (char *)buf + received;
+		length -= received;
+	}
+	
+	return 1;
+}
+
+HIDDEN void brokerAccept(CFSocketRef s, CFSocketCallBackType type, CFDataRef address, const void *data, void *info) {
+	iUSBBrokerRef broker = info;
+	int clientSocket = *(CFSocketNativeHandle *)data;
+	
+	int on = 1;
+	setsockopt(clientSocket, SOL_SOCKET, SO_NOSIGPIPE, &on, sizeof(on));
+	
+	struct __iUSBBrokerConnection *connection = calloc(1, sizeof(struct __iUSBBrokerConnection));
+	connection->broker = broker;
+	connection->socket = clientSocket;
+	
+	pthread_mutex_lock(&broker->lock);
+	if(broker->stopping) {
+		pthread_mutex_unlock(&broker->lock);
+		close(clientSocket);
+		free(connection);
+		return;
+	}
+	connection->next = broker->connections;
+	broker->connections = connection;
+	pthread_mutex_unlock(&broker->lock);
+	
+	pthread_t thread;
+	pthread_attr_t attributes;
+	pthread_attr_init(&attributes);
+	pthread_attr_setdetachstate(&attributes, PTHREAD_CREATE_DETACHED);
+	if(pthread_create(&thread, &attributes, brokerServe, connection) != 0) {
+		shutdown(clientSocket, SHUT_RDWR);
+		brokerServe(connection);
+	}
+	pthread_attr_destroy(&attributes);
+}
+
+HIDDEN void *brokerServe(void *connection_) {
+	struct __iUSBBrokerConnection *connection = connection_;
+	iUSBBrokerRef broker = connection->broker;
+	
+	struct __iUSBBrokerRequest request;
+	int passedDescriptor;
+	while(brokerReceive(connection->socket, &request, sizeof(request), &passedDescriptor)) {
+		char *payload = NULL;
+		if(request.length > 0 && request.type == kBrokerSendCommand) {
+			payload = (request.length <= 0x400 ? malloc(request.length) : NULL);
+			if(payload == NULL || !brokerReceiveAll(connection->socket, payload, request.length)) {
+				if(passedDescriptor >= 0) close(passedDescriptor);
+				free(payload);
+				break;
+			}
+		}
+		
+		brokerHandleRequest(broker, connection, &request, payload, passedDescriptor);
+		
+		if(passedDescriptor >= 0) close(passedDescriptor);
+		free(payload);
+	}
+	
+	close(connection->socket);
+	brokerReleaseShared(connection);
+	
+	pthread_mutex_lock(&broker->lock);
+	struct __iUSBBrokerConnection **link = &broker->connections;
+	while(*link != connection) link = &(*link)->next;
+	*link = connection->next;
+	pthread_cond_broadcast(&broker->connectionClosed);
+	pthread_mutex_unlock(&broker->lock);
+	
+	free(connection);
+	
+	return NULL;
+}
+
+HIDDEN void brokerHandleRequest(iUSBBrokerRef broker, struct __iUSBBrokerConnection *connection, struct __iUSBBrokerRequest *request, char *payload, int passedDescriptor) {
+	struct __iUSBBrokerReply reply = { -1, 0 };
+	int socket = connection->socket;
+	
+	if(request->type == kBrokerAllocate) {
+		brokerReleaseShared(connection);
+		int descriptor = brokerCreateShared(connection, request->length);
+		if(descriptor >= 0) reply.status = 1;
+		
+		brokerSend(socket, &reply, sizeof(reply), NULL, 0, descriptor);
+		if(descriptor >= 0) close(descriptor);
+		return;
+	}
+	
+	if(request->type == kBrokerListDevices) {
+		pthread_mutex_lock(&broker->lock);
+		CFIndex i, count = CFArrayGetCount(broker->devices);
+		iUSBBrokerDevice *list = calloc(count + 1, sizeof(iUSBBrokerDevice));
+		for(i = 0; i < count; ++i) {
+			iUSBRecoveryDeviceRef device = (iUSBRecoveryDeviceRef)CFArrayGetValueAtIndex(broker->devices, i);
+			list[i].ecid = iUSBRecoveryDeviceGetECID(device);
+			list[i].locationID = iUSBRecoveryDeviceGetLocationID(device);
+			list[i].pid = iUSBRecoveryDeviceGetPID(device);
+		}
+		pthread_mutex_unlock(&broker->lock);
+		
+		reply.status = 1;
+		reply.length = count * sizeof(iUSBBrokerDevice);
+		brokerSend(socket, &reply, sizeof(reply), list, reply.length, -1);
+		free(list);
+		return;
+	}
+	
+	iUSBRecoveryDeviceRef device = brokerCopyDevice(broker, request->ecid);
+	if(device == NULL) {
+		brokerSend(socket, &reply, sizeof(reply), NULL, 0, -1);
+		return;
+	}
+	
+	pthread_mutex_lock(&broker->lock);
+	iUSBUploadSchedulerRef scheduler = broker->scheduler;
+	pthread_mutex_unlock(&broker->lock);
+	
+	CFStringRef string = NULL;
+	CFDataRef data = NULL;
+	switch(request->type) {
+		case kBrokerSendCommand:
+			if(payload != NULL && payload[request->length - 1] == '\0') {
+				string = CFStringCreateWithCString(kCFAllocatorDefault, payload, kCFStringEncodingUTF8);
+				reply.status = (string != NULL && iUSBRecoveryDeviceSendCommand(device, string) ? 1 : 0);
+				if(string) CFRelease(string);
+			}
+			break;
+		case kBrokerReadResponse:
+			string = iUSBRecoveryDeviceReadResponse(device, request->arg[0], request->arg[1]);
+			reply.status = 0;
+			if(string != NULL) {
+				char responseBuf[0x800];
+				if(CFStringGetCString(string, responseBuf, sizeof(responseBuf), kCFStringEncodingUTF8)) {
+					reply.status = 1;
+					reply.length = strlen(responseBuf);
+					brokerSend(socket, &reply, sizeof(reply), responseBuf, reply.length, -1);
+				}
+				CFRelease(string);
+			}
+			break;
+		case kBrokerSendFile:
+			// packets are read from the client's file as they go, so it can't fault the broker by shrinking it
+			if(passedDescriptor >= 0) {
+				if(scheduler != NULL)
+					reply.status = (iUSBUploadSchedulerSendFileDescriptor(scheduler, device, passedDescriptor, 0, NULL) ? 1 : 0);
+				else
+					reply.status = (iUSBRecoveryDeviceSendFileDescriptor(device, passedDescriptor, NULL) ? 1 : 0);
+			}
+			break;
+		case kBrokerSendBuffer:
+			if(connection->shared != NULL) {
+				data = CFDataCreateWithBytesNoCopy(kCFAllocatorDefault, connection->shared, connection->sharedLength, kCFAllocatorNull);
+				if(scheduler != NULL)
+					reply.status = (iUSBUploadSchedulerSendData(scheduler, device, data, 0, NULL) ? 1 : 0);
+				else
+					reply.status = (iUSBRecoveryDeviceSendData(device, data, NULL) ? 1 : 0);
+				CFRelease(data);
+			}
+			brokerReleaseShared(connection);
+			break;
+	}
+	
+	iUSBRecoveryDeviceRelease(device);
+	
+	if(reply.length == 0) brokerSend(socket, &reply, sizeof(reply), NULL, 0, -1);
+}
+
+HIDDEN iUSBRecoveryDeviceRef brokerCopyDevice(iUSBBrokerRef broker, uint64_t ecid) {
+	iUSBRecoveryDeviceRef found = NULL;
+	
+	pthread_mutex_lock(&broker->lock);
+	CFIndex i;
+	for(i = 0; i < CFArrayGetCount(broker->devices); ++i) {
+		iUSBRecoveryDeviceRef device = (iUSBRecoveryDeviceRef)CFArrayGetValueAtIndex(broker->devices, i);
+		if(iUSBRecoveryDeviceGetECID(device) == ecid && iUSBRecoveryDeviceIsConnected(device)) {
+			found = iUSBRecoveryDeviceRetain(device);
+			break;
+		}
+	}
+	pthread_mutex_unlock(&broker->lock);
+	
+	return found;
+}
+
+// the broker makes and sizes the shared memory for a client's upload itself. a shared memory object can't be 
+// resized once it has a size, so the client can't shrink it under the broker's mapping and take it down with SIGBUS
+HIDDEN int brokerCreateShared(struct __iUSBBrokerConnection *connection, size_t length) {
+	if(length == 0)
+		return -1;
+	
+	// an unlinked shared memory object is only reachable through the descriptor we hand the client
+	static _Atomic int32_t sequence = 0;
+	char name[64];
+	snprintf(name, sizeof(name), "/iusbcomm.%d.%d", getpid(), (int)atomic_fetch_add(&sequence, 1) + 1);
+	
+	int descriptor = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+	if(descriptor < 0)
+		return -1;
+	
+	shm_unlink(name);
+	
+	if(ftruncate(descriptor, length) != 0) {
+		close(descriptor);
+		return -1;
+	}
+	
+	void *shared = mmap(NULL, length, PROT_READ, MAP_SHARED, descriptor, 0);
+	if(shared == MAP_FAILED) {
+		close(descriptor);
+		return -1;
+	}
+	
+	connection->shared = shared;
+	connection->sharedLength = length;
+	
+	return descriptor;
+}
+
+HIDDEN void brokerReleaseShared(struct __iUSBBrokerConnection *connection) {
+	if(connection->shared != NULL) munmap(connection->shared, connection->sharedLength);
+	connection->shared = NULL;
+	connection->sharedLength = 0;
+}
+
+HIDDEN Boolean clientRequest(iUSBBrokerClientRef client, struct __iUSBBrokerRequest *request, const void *payload, int passedDescriptor, struct __iUSBBrokerReply *reply, void **replyPayload, int *replyDescriptor) {
+	pthread_mutex_lock(&client->lock);
+	
+	size_t payloadLength = (request->type == kBrokerSendCommand ? request->length : 0);
+	if(!brokerSend(client->socket, request, sizeof(*request), payload, payloadLength, passedDescriptor)) {
+		pthread_mutex_unlock(&client->lock);
+		return 0;
+	}
+	
+	// only a reply that hands back a descriptor needs to go through recvmsg
+	int descriptor = -1;
+	if(!(replyDescriptor != NULL ? brokerReceive(client->socket, reply, sizeof(*reply), &descriptor) : brokerReceiveAll(client->socket, reply, sizeof(*reply)))) {
+		pthread_mutex_unlock(&client->lock);
+		return 0;
+	}
+	
+	void *replyBuf = NULL;
+	if(reply->length > 0) {
+		replyBuf = malloc(reply->length);
+		if(replyBuf == NULL || !brokerReceiveAll(client->socket, replyBuf, reply->length)) {
+			pthread_mutex_unlock(&client->lock);
+			if(descriptor >= 0) close(descriptor);
+			free(replyBuf);
+			return 0;
+		}
+	}
+	pthread_mutex_unlock(&client->lock);
+	
+	if(replyDescriptor != NULL) *replyDescriptor = descriptor;
+	
+	if(replyPayload != NULL) {
+		*replyPayload = replyBuf;
+	} else {
+		free(replyBuf);
+	}
+	
+	return 1;
+}
\ No newline at end of file
@@ -0,0 +1,151 @@
+/*
+ *  broker.h
+ *  iusbcomm
+ *
+ *  Created by John Heaton on 5/16/10.
+ *  Copyright 2010 Gojohnnyboi. All rights reserved.
+ *
+ */
+
+#ifndef IUSBCOMM_BROKER_H
+#define IUSBCOMM_BROKER_H
+
+#include "recovery.h"
+#include "scheduler.h"
+
+typedef struct __iUSBBroker *iUSBBrokerRef;
+typedef struct __iUSBBrokerClient *iUSBBrokerClientRef;
+
+/*!
+ @struct iUSBBrokerDevice
+ @field ecid - The ECID of the device, used to address it in every other client call
+ @field pid - The idProduct of the device. See @enum iUSBPID
+ @field locationID - The USB location ID of the device
+ */
+typedef struct {
+	uint64_t ecid;
+	uint32_t locationID;
+	uint16_t pid;
+} iUSBBrokerDevice;
+
+/*!
+ @function iUSBBrokerCreate
+ Create a broker, which shares the devices its process has open with other processes over a 
+ unix domain socket. A device can only be opened by one process at a time, so tools that run 
+ side by side should all go through one broker instead of opening devices themselves.
+ @param socketPath - The path of the socket to listen on. A stale socket at this path is removed. The 
+ socket is made readable and writable by its owner only (0600), so only processes of the same user 
+ can reach the devices.
+ @result A new broker object which the caller is responsible for releasing, or NULL if the 
+ socket could not be created.
+ */
+iUSBBrokerRef iUSBBrokerCreate(CFStringRef socketPath);
+
+/*!
+ @function iUSBBrokerStartOnRunLoop
+ Start accepting clients. Each client is then served on a thread of its own, so one client's 
+ long upload doesn't hold up another's requests to a different device.
+ @param broker - The broker to start.
+ @param runLoop - The run loop to accept clients on. If NULL, CFRunLoopGetCurrent() will be assumed.
+ @param runLoopMode - The mode of your run loop to add to. If NULL, kCFRunLoopDefaultMode will be assumed.
+ @result A boolean value, stating whether the broker was started.
+ */
+Boolean iUSBBrokerStartOnRunLoop(iUSBBrokerRef broker, CFRunLoopRef runLoop, CFStringRef runLoopMode);
+
+/*!
+ @function iUSBBrokerSetUploadScheduler
+ Have uploads from clients go through a scheduler, so they share each bus with the host's own uploads.
+ @param broker - The broker.
+ @param scheduler - The scheduler, or NULL to send uploads straight away. It must outlive the broker.
+ */
+void iUSBBrokerSetUploadScheduler(iUSBBrokerRef broker, iUSBUploadSchedulerRef scheduler);
+
+/*!
+ @function iUSBBrokerHandleConnectionChange
+ Feed a connection change from your listener callback into the broker. Connected devices are 
+ retained and offered to clients until they disconnect.
+ @param broker - The broker.
+ @param device - The device given to your listener callback.
+ @param newConnectionState - The state given to your listener callback.
+ */
+void iUSBBrokerHandleConnectionChange(iUSBBrokerRef broker, iUSBRecoveryDeviceRef device, uint8_t newConnectionState);
+
+/*!
+ @function iUSBBrokerRelease
+ Disconnect all clients, release the broker's devices, remove the socket and deallocate the broker. 
+ Waits for requests that are being served to finish.
+ @param broker - The broker to deallocate
+ */
+void iUSBBrokerRelease(iUSBBrokerRef broker);
+
+/*!
+ @function iUSBBrokerClientCreate
+ Connect to a broker running in another process.
+ @param socketPath - The path the broker was created with.
+ @result A new client object which the caller is responsible for releasing, or NULL if no broker 
+ is listening on that path.
+ */
+iUSBBrokerClientRef iUSBBrokerClientCreate(CFStringRef socketPath);
+
+/*!
+ @function iUSBBrokerClientCopyDevices
+ Get the devices the broker currently has connected.
+ @param client - The client to ask through.
+ @param devices - Set to a list of devices, which the caller is responsible for freeing with free().
+ @result The number of devices in the list, or -1 on failure.
+ */
+CFIndex iUSBBrokerClientCopyDevices(iUSBBrokerClientRef client, iUSBBrokerDevice **devices);
+
+/*!
+ @function iUSBBrokerClientSendCommand
+ Have the broker send a command to a device. See iUSBRecoveryDeviceSendCommand.
+ @param client - The client to send through.
+ @param ecid - The ECID of the device.
+ @param command - The command to send.
+ @result A boolean value, stating whether the command was sent.
+ */
+Boolean iUSBBrokerClientSendCommand(iUSBBrokerClientRef client, uint64_t ecid, CFStringRef command);
+
+/*!
+ @function iUSBBrokerClientReadResponse
+ Have the broker read a response from a device. See iUSBRecoveryDeviceReadResponse.
+ @param client - The client to read through.
+ @param ecid - The ECID of the device.
+ @param noDataTimeout - Time in milliseconds to wait for the device to start responding.
+ @param completionTimeout - Time in milliseconds to wait for the response to finish.
+ @result The response, which the caller is responsible for releasing, or NULL.
+ */
+CFStringRef iUSBBrokerClientReadResponse(iUSBBrokerClientRef client, uint64_t ecid, UInt32 noDataTimeout, UInt32 completionTimeout);
+
+/*!
+ @function iUSBBrokerClientSendData
+ Have the broker send an image to a device. The broker hands back shared memory of the right size, 
+ the data is copied into it once, and the broker sends straight from it, so the data never passes 
+ through the socket.
+ @param client - The client to send through.
+ @param ecid - The ECID of the device.
+ @param data - The data to send.
+ @result A boolean value, stating whether the data was sent.
+ */
+Boolean iUSBBrokerClientSendData(iUSBBrokerClientRef client, uint64_t ecid, CFDataRef data);
+
+/*!
+ @function iUSBBrokerClientSendFile
+ Have the broker send a file to a device. The open file itself is handed to the broker, which 
+ reads each packet from it as it is sent, so a file that is cut short fails the upload rather 
+ than disturbing the broker. The file is never copied through the socket.
+ @param client - The client to send through.
+ @param ecid - The ECID of the device.
+ @param filePath - The path of the file to send.
+ @result A boolean value, stating whether the file was sent.
+ */
+Boolean iUSBBrokerClientSendFile(iUSBBrokerClientRef client, uint64_t ecid, CFStringRef filePath);
+
+/*!
+ @function iUSBBrokerClientRelease
+ Disconnect from the broker and deallocate the client.
+ @param client - The client to deallocate
+ */
+void iUSBBrokerClientRelease(iUSBBrokerClientRef client);
+
+#endif /* IUSBCOMM_BROKER_H */
\ No newline at end of file
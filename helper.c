@@ -9,8 +9,23 @@
 
 #include "helper.h"
 
+#include <unistd.h>
+#include <pthread.h>
+#include <mach/mach.h>
+#include <sys/event.h>
 #include <IOKit/usb/USB.h>
 
+struct __iUSBBufferPool {
+	pthread_mutex_t lock;
+	size_t bufferSize;
+	void *freeBuffers;
+};
+
+static uint32_t crc32Table[256];
+static pthread_once_t crc32TableOnce = PTHREAD_ONCE_INIT;
+
+HIDDEN void crc32TableInit(void);
+
 CFNumberRef AppleIncVendorID() {
 	uint16_t appleID = kIOUSBVendorIDAppleComputer;
 	return CFNumberCreate(kCFAllocatorDefault, kCFNumberSInt16Type, (const void *)&appleID);
@@ -18,4 +33,135 @@ CFNumberRef AppleIncVendorID() {
 
 CFNumberRef numberForUInt16(uint16_t value) {
 	return CFNumberCreate(kCFAllocatorDefault, kCFNumberSInt16Type, (const void *)&value);
+}
+
+uint64_t ecidFromSerialNumber(CFStringRef serial) {
+	if(serial == NULL)
+		return 0;
+	
+	char serialBuf[256];
+	if(!CFStringGetCString(serial, serialBuf, sizeof(serialBuf), kCFStringEncodingUTF8))
+		return 0;
+	
+	char *ecid = strstr(serialBuf, "ECID:");
+	if(ecid == NULL)
+		return 0;
+	
+	return strtoull(ecid + 5, NULL, 16);
+}
+
+HIDDEN void crc32TableInit(void) {
+	uint32_t i, j, value;
+	for(i = 0; i < 256; ++i) {
+		value = i;
+		for(j = 0; j < 8; ++j) {
+			value = (value & 1 ? (value >> 1) ^ 0xEDB88320 : value >> 1);
+		}
+		crc32Table[i] = value;
+	}
+}
+
+uint32_t crc32Update(uint32_t crc, const void *data, size_t length) {
+	// uploads on different devices can run on different threads, so the table is built exactly once
+	pthread_once(&crc32TableOnce, crc32TableInit);
+	
+	const unsigned char *bytes = data;
+	while(length--) {
+		crc = crc32Table[(crc ^ *bytes++) & 0xFF] ^ (crc >> 8);
+	}
+	
+	return crc;
+}
+
+int notificationPortCreateDescriptor(IONotificationPortRef notifyPort, mach_port_t *portSet) {
+	// kqueue can only watch mach port sets, so the notification port goes into a set of its own
+	if(mach_port_allocate(mach_task_self(), MACH_PORT_RIGHT_PORT_SET, portSet) != KERN_SUCCESS) 
+		return -1;
+	
+	if(mach_port_insert_member(mach_task_self(), IONotificationPortGetMachPort(notifyPort), *portSet) != KERN_SUCCESS) {
+		mach_port_destroy(mach_task_self(), *portSet);
+		return -1;
+	}
+	
+	int descriptor = kqueue();
+	if(descriptor < 0) {
+		mach_port_destroy(mach_task_self(), *portSet);
+		return -1;
+	}
+	
+	struct kevent event;
+	EV_SET(&event, *portSet, EVFILT_MACHPORT, EV_ADD, 0, 0, NULL);
+	if(kevent(descriptor, &event, 1, NULL, 0, NULL) != 0) {
+		close(descriptor);
+		mach_port_destroy(mach_task_self(), *portSet);
+		return -1;
+	}
+	
+	return descriptor;
+}
+
+void notificationPortDestroyDescriptor(int descriptor, mach_port_t portSet) {
+	if(descriptor >= 0) close(descriptor);
+	if(portSet != MACH_PORT_NULL) mach_port_destroy(mach_task_self(), portSet);
+}
+
+int notificationPortDispatch(IONotificationPortRef notifyPort, mach_port_t portSet) {
+	union {
+		mach_msg_header_t header;
+		uint8_t body[4096];
+	} msg;
+	int dispatched = 0;
+	
+	while(mach_msg(&msg.header, MACH_RCV_MSG | MACH_RCV_TIMEOUT, 0, sizeof(msg), portSet, 0, MACH_PORT_NULL) == MACH_MSG_SUCCESS) {
+		IODispatchCalloutFromMessage(NULL, &msg.header, notifyPort);
+		dispatched++;
+	}
+	
+	return dispatched;
+}
+
+iUSBBufferPoolRef bufferPoolCreate(size_t bufferSize) {
+	iUSBBufferPoolRef newPool = calloc(1, sizeof(struct __iUSBBufferPool));
+	
+	// whole pages, so every buffer starts and ends on a page boundary and the kernel can map it instead of copying
+	size_t pageSize = (size_t)getpagesize();
+	newPool->bufferSize = ((bufferSize + pageSize - 1) / pageSize) * pageSize;
+	pthread_mutex_init(&newPool->lock, NULL);
+	
+	return newPool;
+}
+
+void *bufferPoolGet(iUSBBufferPoolRef pool) {
+	pthread_mutex_lock(&pool->lock);
+	void *buf = pool->freeBuffers;
+	if(buf != NULL) pool->freeBuffers = *(void **)buf;
+	pthread_mutex_unlock(&pool->lock);
+	
+	if(buf == NULL && posix_memalign(&buf, (size_t)getpagesize(), pool->bufferSize) != 0)
+		return NULL;
+	
+	return buf;
+}
+
+void bufferPoolPut(iUSBBufferPoolRef pool, void *buf) {
+	if(buf == NULL)
+		return;
+	
+	pthread_mutex_lock(&pool->lock);
+	*(void **)buf = pool->freeBuffers;
+	pool->freeBuffers = buf;
+	pthread_mutex_unlock(&pool->lock);
+}
+
+void bufferPoolRelease(iUSBBufferPoolRef pool) {
+	if(pool != NULL) {
+		while(pool->freeBuffers != NULL) {
+			void *buf = pool->freeBuffers;
+			pool->freeBuffers = *(void **)buf;
+			free(buf);
+		}
+		
+		pthread_mutex_destroy(&pool->lock);
+		free(pool);
+	}
 }
\ No newline at end of file
@@ -11,6 +11,8 @@
 #define IUSBCOMM_HELPER_H
 
 #include <CoreFoundation/CoreFoundation.h>
+#include <IOKit/IOKitLib.h>
+#include <IOKit/usb/IOUSBLib.h>
 
 enum iUSBRequest {
 	kUSBRequestCommand = 0x40,
@@ -18,8 +20,25 @@ enum iUSBRequest {
 	kUSBRequestStatus = 0xA1
 };
 
+typedef struct __iUSBBufferPool *iUSBBufferPoolRef;
+
 CFNumberRef AppleIncVendorID();
 CFNumberRef numberForUInt16(uint16_t value);
+uint64_t ecidFromSerialNumber(CFStringRef serial);
+uint32_t crc32Update(uint32_t crc, const void *data, size_t length);
+int notificationPortCreateDescriptor(IONotificationPortRef notifyPort, mach_port_t *portSet);
+void notificationPortDestroyDescriptor(int descriptor, mach_port_t portSet);
+int notificationPortDispatch(IONotificationPortRef notifyPort, mach_port_t portSet);
+iUSBBufferPoolRef bufferPoolCreate(size_t bufferSize);
+void *bufferPoolGet(iUSBBufferPoolRef pool);
+void bufferPoolPut(iUSBBufferPoolRef pool, void *buf);
+void bufferPoolRelease(iUSBBufferPoolRef pool);
+IOReturn traceDeviceRequest(IOUSBDeviceInterface **deviceHandle, uint64_t deviceID, IOUSBDevRequest *request);
+IOReturn traceReadPipe(IOUSBInterfaceInterface182 **interfaceHandle, uint64_t deviceID, UInt8 pipeRef, void *buf, UInt32 *size, UInt32 noDataTimeout, UInt32 completionTimeout);
+IOReturn traceWritePipe(IOUSBInterfaceInterface182 **interfaceHandle, uint64_t deviceID, UInt8 pipeRef, void *buf, UInt32 size, UInt32 noDataTimeout, UInt32 completionTimeout);
+IOReturn traceDeviceRequestAsync(IOUSBDeviceInterface **deviceHandle, uint64_t deviceID, IOUSBDevRequest *request, IOAsyncCallback1 callback, void *refCon, CFRunLoopRef runLoop, CFStringRef runLoopMode);
+IOReturn traceReadPipeAsync(IOUSBInterfaceInterface182 **interfaceHandle, uint64_t deviceID, UInt8 pipeRef, void *buf, UInt32 size, UInt32 noDataTimeout, UInt32 completionTimeout, IOAsyncCallback1 callback, void *refCon, CFRunLoopRef runLoop, CFStringRef runLoopMode);
+Boolean traceReplayActive(void);
 
 #define HIDDEN __attribute__ ((visibility("hidden")))
 
@@ -13,49 +13,67 @@
 #include <IOKit/IOKitLib.h>
 #include <IOKit/usb/IOUSBLib.h>
 
+#define kListenerMaxIterators 16
+#define kListenerMaxDetachedDevices 64
+
 struct __iUSBListener {
 	int listenModes;
+	IONotificationPortRef notifyPort;
+	int eventDescriptor;
+	mach_port_t eventPortSet;
+	io_iterator_t iterators[kListenerMaxIterators];
+	int iteratorCount;
 	struct {
 		uint8_t subscribed;
-		IONotificationPortRef notifyPort;
 		iUSBRecoveryDeviceConnectionChangeCallback connectionCallback;
-		iUSBRecoveryDeviceRef currentDevice;
+		CFMutableArrayRef devices;
+		Boolean reattachDevices;
 	} recoveryVars;
+	struct {
+		uint8_t subscribed;
+		iUSBNormalDeviceConnectionChangeCallback connectionCallback;
+		CFMutableArrayRef devices;
+	} normalVars;
 };
 
 HIDDEN iUSBRecoveryDeviceRef createRecoveryDevice(uint16_t pid, io_service_t service);
 HIDDEN Boolean deviceOpen(iUSBRecoveryDeviceRef device, CFMutableDictionaryRef matching);
+HIDDEN void deviceClose(iUSBRecoveryDeviceRef device, Boolean keepQueued);
+HIDDEN Boolean deviceReattach(iUSBRecoveryDeviceRef device, uint16_t pid, io_service_t service);
+HIDDEN Boolean deviceMatchesService(iUSBRecoveryDeviceRef device, io_service_t service);
+HIDDEN iUSBNormalDeviceRef createNormalDevice(uint16_t pid, io_service_t service);
+HIDDEN Boolean normalDeviceMatchesService(iUSBNormalDeviceRef device, io_service_t service);
+HIDDEN void normalDeviceClose(iUSBNormalDeviceRef device);
 
+HIDDEN Boolean listenerSubscribe(iUSBListenerRef listener);
+HIDDEN int subscribeToConnections(iUSBListenerRef listener, uint16_t pid, uint16_t pidMask, IOServiceMatchingCallback attached, IOServiceMatchingCallback detached);
 HIDDEN int subscribeToRecoveryConnections(iUSBListenerRef listener, uint16_t *pids, int pid_count); 
 HIDDEN void recoveryDeviceAttached(void *refCon, io_iterator_t iterator);
 HIDDEN void recoveryDeviceDetached(void *refCon, io_iterator_t iterator);
+HIDDEN void normalDeviceAttached(void *refCon, io_iterator_t iterator);
+HIDDEN void normalDeviceDetached(void *refCon, io_iterator_t iterator);
+HIDDEN uint16_t serviceGetPID(io_service_t service);
+HIDDEN CFIndex listenerFindDetachedDevice(iUSBListenerRef listener, uint64_t ecid);
+HIDDEN CFIndex listenerFindDeviceForService(iUSBListenerRef listener, io_service_t service);
+HIDDEN void listenerTrimDetachedDevices(iUSBListenerRef listener);
 
 iUSBListenerRef iUSBListenerCreate(iUSBListenerType listenModes, iUSBRecoveryDeviceConnectionChangeCallback recoveryCallback) {
 	iUSBListenerRef newListener = calloc(1, sizeof(struct __iUSBListener));
 	if(recoveryCallback != NULL) newListener->recoveryVars.connectionCallback = recoveryCallback;
 	newListener->listenModes = listenModes;
+	newListener->recoveryVars.devices = CFArrayCreateMutable(kCFAllocatorDefault, 0, NULL);
+	newListener->normalVars.devices = CFArrayCreateMutable(kCFAllocatorDefault, 0, NULL);
+	newListener->eventDescriptor = -1;
 	
 	return newListener;
 }
 
 Boolean iUSBListenerStartListeningOnRunLoop(iUSBListenerRef listener, CFRunLoopRef runLoop_, CFStringRef runLoopMode_) {
-	if(listener == NULL) return 0;
-	
-	if(listener->listenModes & kUSBListenerTypeRecovery) {
-		if(!listener->recoveryVars.subscribed) {
-			uint16_t pids[3] = {
-				kUSBPIDRecovery,
-				kUSBPIDDFU,
-				kUSBPIDWTF
-			};
-			if(subscribeToRecoveryConnections(listener, pids, 3) < 0) return 0;
-			listener->recoveryVars.subscribed = 1;
-		}
-	}
+	if(listener == NULL || !listenerSubscribe(listener)) return 0;
 
 	CFRunLoopRef runLoop = (runLoop_ == NULL ? CFRunLoopGetCurrent() : runLoop_);
 	CFStringRef runLoopMode = (runLoopMode_ == NULL ? kCFRunLoopDefaultMode : runLoopMode_);
-	CFRunLoopSourceRef notifySource = IONotificationPortGetRunLoopSource(listener->recoveryVars.notifyPort);
+	CFRunLoopSourceRef notifySource = IONotificationPortGetRunLoopSource(listener->notifyPort);
 	
 	if(!CFRunLoopContainsSource(runLoop, notifySource, runLoopMode)) {
 		CFRunLoopAddSource(runLoop, notifySource, runLoopMode);
@@ -65,11 +83,11 @@ Boolean iUSBListenerStartListeningOnRunLoop(iUSBListenerRef listener, CFRunLoopR
 }
 
 void iUSBListenerStopListeningOnRunLoop(iUSBListenerRef listener, CFRunLoopRef runLoop_, CFStringRef runLoopMode_) {
-	if(listener == NULL || !listener->recoveryVars.subscribed) return;
+	if(listener == NULL || listener->notifyPort == NULL) return;
 	
 	CFRunLoopRef runLoop = (runLoop_ == NULL ? CFRunLoopGetCurrent() : runLoop_);
 	CFStringRef runLoopMode = (runLoopMode_ == NULL ? kCFRunLoopDefaultMode : runLoopMode_);
-	CFRunLoopSourceRef notifySource = IONotificationPortGetRunLoopSource(listener->recoveryVars.notifyPort);
+	CFRunLoopSourceRef notifySource = IONotificationPortGetRunLoopSource(listener->notifyPort);
 	
 	if(CFRunLoopContainsSource(runLoop, notifySource, runLoopMode)) {
 		CFRunLoopRemoveSource(runLoop, notifySource, runLoopMode);
@@ -78,54 +96,149 @@ void iUSBListenerStopListeningOnRunLoop(iUSBListenerRef listener, CFRunLoopRef r
 	return;
 }
 
+int iUSBListenerGetEventDescriptor(iUSBListenerRef listener) {
+	if(listener == NULL || !listenerSubscribe(listener)) return -1;
+	
+	if(listener->eventDescriptor < 0) {
+		listener->eventDescriptor = notificationPortCreateDescriptor(listener->notifyPort, &listener->eventPortSet);
+	}
+	
+	return listener->eventDescriptor;
+}
+
+int iUSBListenerProcessEvents(iUSBListenerRef listener) {
+	if(listener == NULL || listener->eventDescriptor < 0) return 0;
+	
+	return notificationPortDispatch(listener->notifyPort, listener->eventPortSet);
+}
+
+void iUSBListenerSetNormalDeviceCallback(iUSBListenerRef listener, iUSBNormalDeviceConnectionChangeCallback normalCallback) {
+	if(listener == NULL) return;
+	
+	listener->normalVars.connectionCallback = normalCallback;
+}
+
+void iUSBListenerSetReattachesDevices(iUSBListenerRef listener, Boolean reattach) {
+	if(listener == NULL) return;
+	
+	listener->recoveryVars.reattachDevices = reattach;
+}
+
 void iUSBListenerRelease(iUSBListenerRef listener) {
 	if(listener != NULL) {
-		if(listener->recoveryVars.subscribed) {
-			if(listener->recoveryVars.notifyPort) IONotificationPortDestroy(listener->recoveryVars.notifyPort);
+		if(listener->eventDescriptor >= 0) {
+			notificationPortDestroyDescriptor(listener->eventDescriptor, listener->eventPortSet);
+		}
+		
+		// the iterators hold the notification requests; destroying the port alone leaves them registered
+		int i;
+		for(i = 0; i < listener->iteratorCount; ++i) {
+			IOObjectRelease(listener->iterators[i]);
+		}
+		
+		if(listener->notifyPort) IONotificationPortDestroy(listener->notifyPort);
+		
+		if(listener->recoveryVars.reattachDevices) {
+			CFIndex index;
+			for(index = 0; index < CFArrayGetCount(listener->recoveryVars.devices); ++index) {
+				iUSBRecoveryDeviceRelease((iUSBRecoveryDeviceRef)CFArrayGetValueAtIndex(listener->recoveryVars.devices, index));
+			}
 		}
+		CFRelease(listener->recoveryVars.devices);
+		CFRelease(listener->normalVars.devices);
 		
 		free(listener);
 		listener = NULL;
 	}
 }
 
+HIDDEN Boolean listenerSubscribe(iUSBListenerRef listener) {
+	if(listener->notifyPort == NULL) {
+		listener->notifyPort = IONotificationPortCreate(kIOMasterPortDefault);
+		if(listener->notifyPort == NULL) return 0;
+	}
+	
+	if(listener->listenModes & kUSBListenerTypeRecovery) {
+		if(!listener->recoveryVars.subscribed) {
+			uint16_t pids[3] = {
+				kUSBPIDRecovery,
+				kUSBPIDDFU,
+				kUSBPIDWTF
+			};
+			if(subscribeToRecoveryConnections(listener, pids, 3) < 0) return 0;
+			listener->recoveryVars.subscribed = 1;
+		}
+	}
+	
+	if(listener->listenModes & kUSBListenerTypeNormal) {
+		if(!listener->normalVars.subscribed) {
+			// 0x1290-0x12AF, as two blocks of 16 so the mask can't reach the recovery pids
+			if(subscribeToConnections(listener, kUSBPIDNormalFirst, 0xFFF0, normalDeviceAttached, normalDeviceDetached) < 0) return 0;
+			if(subscribeToConnections(listener, kUSBPIDNormalFirst + 0x10, 0xFFF0, normalDeviceAttached, normalDeviceDetached) < 0) return 0;
+			listener->normalVars.subscribed = 1;
+		}
+	}
+	
+	return 1;
+}
+
+HIDDEN int subscribeToConnections(iUSBListenerRef listener, uint16_t pid, uint16_t pidMask, IOServiceMatchingCallback attached, IOServiceMatchingCallback detached) {
+	CFMutableDictionaryRef matching = IOServiceMatching(kIOUSBDeviceClassName);
+	if(matching == NULL) {
+		return -1;
+	}
+	
+	CFNumberRef idVendor = AppleIncVendorID();
+	CFNumberRef idProduct = numberForUInt16(pid);
+	
+	CFDictionarySetValue(matching, CFSTR(kUSBVendorID), idVendor);
+	CFDictionarySetValue(matching, CFSTR(kUSBProductID), idProduct);
+	
+	CFRelease(idVendor);
+	CFRelease(idProduct);
+	
+	if(pidMask != 0) {
+		CFNumberRef idProductMask = numberForUInt16(pidMask);
+		CFDictionarySetValue(matching, CFSTR(kUSBProductIDMask), idProductMask);
+		CFRelease(idProductMask);
+	}
+	
+	if(listener->iteratorCount + 2 > kListenerMaxIterators) {
+		CFRelease(matching);
+		return -1;
+	}
+	
+	// each notification consumes a reference to the dictionary, whether or not it succeeds
+	CFRetain(matching);
+	
+	io_iterator_t attachIterator;
+	if(IOServiceAddMatchingNotification(listener->notifyPort, kIOFirstMatchNotification, matching, attached, listener, &attachIterator) != KERN_SUCCESS) {
+		CFRelease(matching);
+		return -1;
+	}
+	
+	listener->iterators[listener->iteratorCount++] = attachIterator;
+	attached(listener, attachIterator);
+	
+	io_iterator_t detachIterator;
+	if(IOServiceAddMatchingNotification(listener->notifyPort, kIOTerminatedNotification, matching, detached, listener, &detachIterator) != KERN_SUCCESS) {
+		return -1;
+	}
+	
+	listener->iterators[listener->iteratorCount++] = detachIterator;
+	detached(listener, detachIterator);
+	
+	return 0;
+}
+
 HIDDEN int subscribeToRecoveryConnections(iUSBListenerRef listener, uint16_t *pids, int pid_count) {
 	if(listener == NULL) return -1;
-
-	listener->recoveryVars.notifyPort = IONotificationPortCreate(kIOMasterPortDefault);
 	
 	int i;
 	for(i = 0; i < pid_count; ++i) {
-		CFMutableDictionaryRef matching = IOServiceMatching(kIOUSBDeviceClassName);
-		if(matching == NULL) {
-			return -1;
-		}
-		
-		uint16_t idVendorApple = 0x05AC, PID = pids[i];
-		CFNumberRef idVendor = CFNumberCreate(kCFAllocatorDefault, kCFNumberSInt16Type, &idVendorApple);
-		CFNumberRef idProduct = CFNumberCreate(kCFAllocatorDefault, kCFNumberSInt16Type, &PID);
-		
-		CFDictionarySetValue(matching, CFSTR(kUSBVendorID), idVendor);
-		CFDictionarySetValue(matching, CFSTR(kUSBProductID), idProduct);
-		
-		CFRelease(idVendor);
-		CFRelease(idProduct);
-		
-		CFRetain(matching);
-		
-		io_iterator_t attachIterator;
-		if(IOServiceAddMatchingNotification(listener->recoveryVars.notifyPort, kIOFirstMatchNotification, matching, recoveryDeviceAttached, listener, &attachIterator) != KERN_SUCCESS) {
+		if(subscribeToConnections(listener, pids[i], 0, recoveryDeviceAttached, recoveryDeviceDetached) < 0) {
 			return -1;
 		}
-		
-		recoveryDeviceAttached(listener, attachIterator);
-		
-		io_iterator_t detachIterator;
-		if(IOServiceAddMatchingNotification(listener->recoveryVars.notifyPort, kIOTerminatedNotification, matching, recoveryDeviceDetached, listener, &detachIterator) != KERN_SUCCESS) {
-			return -1;
-		}
-		
-		recoveryDeviceDetached(listener, detachIterator);
 	}
 	
 	return 0;
@@ -136,22 +249,36 @@ HIDDEN void recoveryDeviceAttached(void *refCon, io_iterator_t iterator) {
 	if(listener != NULL) {
 		io_service_t service;
 		while(service = IOIteratorNext(iterator)) {
-			if(listener->recoveryVars.connectionCallback != NULL) {
-				CFNumberRef CFPID = IORegistryEntryCreateCFProperty(service, CFSTR(kUSBProductID), kCFAllocatorDefault, 0);
-				uint16_t idProduct;
-				CFNumberGetValue(CFPID, kCFNumberSInt16Type, &idProduct);
-				CFRelease(CFPID);
+			if(listener->recoveryVars.connectionCallback == NULL) {
+				IOObjectRelease(service);
+				continue;
+			}
 			
-				iUSBRecoveryDeviceRef newDevice = createRecoveryDevice(idProduct, service);
-				if(!deviceOpen(newDevice, NULL)) {
-					free(newDevice);
-					IOObjectRelease(service);
-					return;
-				}
+			uint16_t idProduct = serviceGetPID(service);
+			
+			CFIndex index = -1;
+			if(listener->recoveryVars.reattachDevices) {
+				CFStringRef serial = IORegistryEntryCreateCFProperty(service, CFSTR(kUSBSerialNumberString), kCFAllocatorDefault, 0);
+				uint64_t ecid = ecidFromSerialNumber(serial);
+				if(serial) CFRelease(serial);
 				
-				listener->recoveryVars.currentDevice = newDevice;
-				listener->recoveryVars.connectionCallback(listener->recoveryVars.currentDevice, kUSBConnected);
+				if(ecid != 0) index = listenerFindDetachedDevice(listener, ecid);
 			}
+			
+			iUSBRecoveryDeviceRef device;
+			if(index >= 0) {
+				device = (iUSBRecoveryDeviceRef)CFArrayGetValueAtIndex(listener->recoveryVars.devices, index);
+				if(!deviceReattach(device, idProduct, service)) continue;
+			} else {
+				device = createRecoveryDevice(idProduct, service);
+				if(!deviceOpen(device, NULL)) {
+					iUSBRecoveryDeviceRelease(device);
+					continue;
+				}
+				CFArrayAppendValue(listener->recoveryVars.devices, device);
+			}
+			
+			listener->recoveryVars.connectionCallback(device, kUSBConnected);
 		}
 	}
 }
@@ -161,9 +288,117 @@ HIDDEN void recoveryDeviceDetached(void *refCon, io_iterator_t iterator) {
 	if(listener != NULL) {
 		io_service_t service;
 		while(service = IOIteratorNext(iterator)) {
+			CFIndex index = listenerFindDeviceForService(listener, service);
+			IOObjectRelease(service);
+			if(index < 0) continue;
+			
+			iUSBRecoveryDeviceRef device = (iUSBRecoveryDeviceRef)CFArrayGetValueAtIndex(listener->recoveryVars.devices, index);
+			
+			// closing marks the device disconnected for anyone else still holding it, like the broker.
+			// a reattaching listener owns its devices and holds their queued requests until they come back;
+			// otherwise the callback is expected to release it
+			deviceClose(device, listener->recoveryVars.reattachDevices);
+			if(!listener->recoveryVars.reattachDevices) CFArrayRemoveValueAtIndex(listener->recoveryVars.devices, index);
+			
 			if(listener->recoveryVars.connectionCallback != NULL) {
-				listener->recoveryVars.connectionCallback(listener->recoveryVars.currentDevice, kUSBDisconnected);
+				listener->recoveryVars.connectionCallback(device, kUSBDisconnected);
 			}
+			
+			if(listener->recoveryVars.reattachDevices) listenerTrimDetachedDevices(listener);
 		}
 	}
 }
+
+HIDDEN CFIndex listenerFindDetachedDevice(iUSBListenerRef listener, uint64_t ecid) {
+	CFIndex i;
+	for(i = 0; i < CFArrayGetCount(listener->recoveryVars.devices); ++i) {
+		iUSBRecoveryDeviceRef device = (iUSBRecoveryDeviceRef)CFArrayGetValueAtIndex(listener->recoveryVars.devices, i);
+		if(!iUSBRecoveryDeviceIsConnected(device) && iUSBRecoveryDeviceGetECID(device) == ecid) return i;
+	}
+	
+	return -1;
+}
+
+HIDDEN CFIndex listenerFindDeviceForService(iUSBListenerRef listener, io_service_t service) {
+	CFIndex i;
+	for(i = 0; i < CFArrayGetCount(listener->recoveryVars.devices); ++i) {
+		iUSBRecoveryDeviceRef device = (iUSBRecoveryDeviceRef)CFArrayGetValueAtIndex(listener->recoveryVars.devices, i);
+		if(iUSBRecoveryDeviceIsConnected(device) && deviceMatchesService(device, service)) return i;
+	}
+	
+	return -1;
+}
+
+HIDDEN void listenerTrimDetachedDevices(iUSBListenerRef listener) {
+	CFIndex i, detached = 0;
+	for(i = 0; i < CFArrayGetCount(listener->recoveryVars.devices); ++i) {
+		if(!iUSBRecoveryDeviceIsConnected((iUSBRecoveryDeviceRef)CFArrayGetValueAtIndex(listener->recoveryVars.devices, i))) detached++;
+	}
+	
+	// devices are appended as they first attach, so the ones released here are the longest known
+	for(i = 0; i < CFArrayGetCount(listener->recoveryVars.devices) && detached > kListenerMaxDetachedDevices; ) {
+		iUSBRecoveryDeviceRef device = (iUSBRecoveryDeviceRef)CFArrayGetValueAtIndex(listener->recoveryVars.devices, i);
+		if(iUSBRecoveryDeviceIsConnected(device)) {
+			++i;
+			continue;
+		}
+		
+		// it won't be reattached now, so anything still waiting for it fails
+		deviceClose(device, 0);
+		CFArrayRemoveValueAtIndex(listener->recoveryVars.devices, i);
+		iUSBRecoveryDeviceRelease(device);
+		detached--;
+	}
+}
+
+HIDDEN void normalDeviceAttached(void *refCon, io_iterator_t iterator) {
+	iUSBListenerRef listener = refCon;
+	if(listener != NULL) {
+		io_service_t service;
+		while(service = IOIteratorNext(iterator)) {
+			if(listener->normalVars.connectionCallback == NULL) {
+				IOObjectRelease(service);
+				continue;
+			}
+			
+			iUSBNormalDeviceRef device = createNormalDevice(serviceGetPID(service), service);
+			if(device == NULL) continue;
+			
+			CFArrayAppendValue(listener->normalVars.devices, device);
+			listener->normalVars.connectionCallback(device, kUSBConnected);
+		}
+	}
+}
+
+HIDDEN void normalDeviceDetached(void *refCon, io_iterator_t iterator) {
+	iUSBListenerRef listener = refCon;
+	if(listener != NULL) {
+		io_service_t service;
+		while(service = IOIteratorNext(iterator)) {
+			CFIndex i, count = CFArrayGetCount(listener->normalVars.devices);
+			for(i = 0; i < count; ++i) {
+				iUSBNormalDeviceRef device = (iUSBNormalDeviceRef)CFArrayGetValueAtIndex(listener->normalVars.devices, i);
+				if(!normalDeviceMatchesService(device, service)) continue;
+				
+				CFArrayRemoveValueAtIndex(listener->normalVars.devices, i);
+				normalDeviceClose(device);
+				if(listener->normalVars.connectionCallback != NULL) {
+					listener->normalVars.connectionCallback(device, kUSBDisconnected);
+				}
+				break;
+			}
+			IOObjectRelease(service);
+		}
+	}
+}
+
+HIDDEN uint16_t serviceGetPID(io_service_t service) {
+	uint16_t idProduct = 0;
+	CFNumberRef CFPID = IORegistryEntryCreateCFProperty(service, CFSTR(kUSBProductID), kCFAllocatorDefault, 0);
+	if(CFPID != NULL) {
+		CFNumberGetValue(CFPID, kCFNumberSInt16Type, &idProduct);
+		CFRelease(CFPID);
+	}
+	
+	return idProduct;
+}
\ No newline at end of file
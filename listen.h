@@ -11,6 +11,7 @@
 #define IUSBCOMM_LISTEN_H
 
 #include "recovery.h"
+#include "normal.h"
 
 typedef struct __iUSBListener *iUSBListenerRef;
 
@@ -30,7 +31,9 @@ typedef enum {
  for the specified modes.
  @param listenModes - kUSBListenerType value(s). ex: (kUSBListenerTypeNormal | kUSBListenerTypeRecovery)
  @param recoveryCallback - The callback for recovery device connections
- Note: Do *NOT* release a iUSBRecoveryDeviceRef object until you receive a detach notification. It will cause issues.
+ Note: Do *NOT* release a iUSBRecoveryDeviceRef object until you receive a detach notification. It will cause issues. 
+ With iUSBListenerSetReattachesDevices, a device passed to the callback must be retained with 
+ iUSBRecoveryDeviceRetain if it is used once the callback returns.
  @result A new listener object which the caller is responsible for releasing
  */
 iUSBListenerRef iUSBListenerCreate(iUSBListenerType listenModes, iUSBRecoveryDeviceConnectionChangeCallback recoveryCallback);
@@ -53,6 +56,51 @@ Boolean iUSBListenerStartListeningOnRunLoop(iUSBListenerRef listener, CFRunLoopR
  */
 void iUSBListenerStopListeningOnRunLoop(iUSBListenerRef listener, CFRunLoopRef runLoop, CFStringRef runLoopMode);
 
+/*!
+ @function iUSBListenerGetEventDescriptor
+ Setup for listening without a run loop, and return a file descriptor that becomes readable when 
+ notifications are pending. The descriptor is a kqueue, so it can be added to select(), poll() or 
+ another kqueue. When it is readable, call iUSBListenerProcessEvents.
+ Note: Use either this or iUSBListenerStartListeningOnRunLoop for a listener, not both.
+ @param listener - The listener to get the descriptor of.
+ @result The descriptor, owned by the listener, or -1 on failure.
+ */
+int iUSBListenerGetEventDescriptor(iUSBListenerRef listener);
+
+/*!
+ @function iUSBListenerProcessEvents
+ Deliver all pending notifications to the listener's callbacks without blocking.
+ @param listener - The listener whose event descriptor became readable.
+ @result The number of notifications delivered.
+ */
+int iUSBListenerProcessEvents(iUSBListenerRef listener);
+
+/*!
+ @function iUSBListenerSetNormalDeviceCallback
+ Set the callback for connections of devices booted into the OS, for listeners created with kUSBListenerTypeNormal.
+ Each connected device is opened and its usbmux interface set up before the callback is called.
+ Note: Release the iUSBNormalDeviceRef when you receive its detach notification, not before.
+ @param listener - The listener to configure. Should be called before the listener starts listening.
+ @param normalCallback - The callback for normal device connections
+ */
+void iUSBListenerSetNormalDeviceCallback(iUSBListenerRef listener, iUSBNormalDeviceConnectionChangeCallback normalCallback);
+
+/*!
+ @function iUSBListenerSetReattachesDevices
+ Keep one device object per physical device (matched by ECID) across disconnects and mode changes.
+ When a device comes back, in any mode, the same iUSBRecoveryDeviceRef is reopened and passed to the 
+ connection callback again, keeping its ECID, last transfer state and any async requests still queued.
+ Note: In this mode the listener owns the device objects. Do *NOT* release them in the disconnect callback; 
+ they are released with the listener. Only the 64 most recently seen disconnected devices are kept, so a 
+ long running listener doesn't grow with every device it has ever seen. The older ones are released on a 
+ later detach without notice, so you *must* call iUSBRecoveryDeviceRetain on any device you hold on to past 
+ the connection callback, and release it yourself when done. A device that was not retained may be 
+ deallocated while you still hold a pointer to it.
+ @param listener - The listener to configure. Should be called before the listener starts listening.
+ @param reattach - A boolean value, stating whether device objects should be kept and reattached.
+ */
+void iUSBListenerSetReattachesDevices(iUSBListenerRef listener, Boolean reattach);
+
 /*!
  @function iUSBListenerRelease
  Safely clean up and deallocate a listener object
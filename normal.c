@@ -8,4 +8,709 @@
  */
 
 #include "normal.h"
+#include "helper.h"
 
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/time.h>
+#include <arpa/inet.h>
+#include <IOKit/IOKitLib.h>
+#include <IOKit/IOCFPlugIn.h>
+#include <IOKit/usb/IOUSBLib.h>
+
+#define kNormalBufferSize (3 * 16384)
+#define kNormalReceiveWindow (128 * 1024)
+#define kNormalMaxPacketSize (64 * 1024)
+
+enum iUSBMuxProtocol {
+	kMuxProtocolVersion = 0,
+	kMuxProtocolTCP = 6
+};
+
+enum iUSBMuxTCPFlag {
+	kMuxTCPFIN = 0x01,
+	kMuxTCPSYN = 0x02,
+	kMuxTCPRST = 0x04,
+	kMuxTCPACK = 0x10
+};
+
+enum iUSBNormalConnectionState {
+	kNormalConnecting,
+	kNormalConnected,
+	kNormalClosed
+};
+
+struct __iUSBMuxHeader {
+	uint32_t protocol;
+	uint32_t length;
+} __attribute__((packed));
+
+struct __iUSBMuxVersion {
+	uint32_t major;
+	uint32_t minor;
+	uint32_t padding;
+} __attribute__((packed));
+
+struct __iUSBMuxTCPHeader {
+	uint16_t sport;
+	uint16_t dport;
+	uint32_t seq;
+	uint32_t ack;
+	uint8_t offset;
+	uint8_t flags;
+	uint16_t window;
+	uint16_t checksum;
+	uint16_t urgent;
+} __attribute__((packed));
+
+#define kNormalMaxPayload (kNormalBufferSize - sizeof(struct __iUSBMuxHeader) - sizeof(struct __iUSBMuxTCPHeader))
+
+struct __iUSBNormalConnection {
+	iUSBNormalDeviceRef device;
+	uint16_t sport;
+	uint16_t dport;
+	uint32_t txSeq;
+	uint32_t txAcked;
+	uint32_t txWindow;
+	uint32_t rxSeq;
+	int state;
+	CFMutableDataRef received;
+	struct __iUSBNormalConnection *next;
+};
+
+struct __iUSBNormalDevice {
+	_Atomic int32_t refCount;
+	uint16_t idProduct;
+	io_service_t usbService;
+	uint64_t registryID;
+	IOUSBDeviceInterface **deviceHandle;
+	IOUSBInterfaceInterface182 **interfaceHandle;
+	UInt8 inPipeRef;
+	UInt8 outPipeRef;
+	UInt16 outMaxPacketSize;
+	Boolean open;
+	uint32_t muxVersion;
+	pthread_mutex_t lock;
+	pthread_cond_t incoming;
+	pthread_mutex_t writeLock;
+	Boolean pumping;
+	uint16_t nextPort;
+	struct __iUSBNormalConnection *connections;
+	iUSBBufferPoolRef buffers;
+	unsigned char *receiveBuffer;
+	size_t receiveLength;
+};
+
+HIDDEN iUSBNormalDeviceRef createNormalDevice(uint16_t pid, io_service_t service);
+HIDDEN Boolean normalDeviceMatchesService(iUSBNormalDeviceRef device, io_service_t service);
+HIDDEN void normalDeviceClose(iUSBNormalDeviceRef device);
+HIDDEN Boolean normalDeviceOpen(iUSBNormalDeviceRef device);
+HIDDEN Boolean normalDeviceFindMuxInterface(iUSBNormalDeviceRef device);
+HIDDEN Boolean normalSendPacket(iUSBNormalDeviceRef device, uint32_t protocol, const void *header, size_t headerLength, const void *payload, size_t payloadLength);
+HIDDEN Boolean normalSendTCP(iUSBNormalConnectionRef connection, uint8_t flags, const void *payload, size_t payloadLength);
+HIDDEN void normalBuildTCPHeader(iUSBNormalConnectionRef connection, uint8_t flags, size_t payloadLength, struct __iUSBMuxTCPHeader *header);
+HIDDEN Boolean normalDeviceIsOpen(iUSBNormalDeviceRef device);
+HIDDEN int normalConnectionGetState(iUSBNormalConnectionRef connection);
+HIDDEN void normalPump(iUSBNormalDeviceRef device, UInt32 timeout);
+HIDDEN void normalReadPacket(iUSBNormalDeviceRef device, UInt32 timeout);
+HIDDEN void normalDispatchPacket(iUSBNormalDeviceRef device, const unsigned char *packet, size_t length);
+HIDDEN void normalHandleTCP(iUSBNormalDeviceRef device, const unsigned char *packet, size_t length);
+HIDDEN UInt32 normalTimeLeft(CFAbsoluteTime deadline);
+
+iUSBNormalDeviceRef iUSBNormalDeviceRetain(iUSBNormalDeviceRef device) {
+	if(device != NULL) atomic_fetch_add(&device->refCount, 1);
+	
+	return device;
+}
+
+void iUSBNormalDeviceRelease(iUSBNormalDeviceRef device) {
+	if(device != NULL) {
+		// every connection holds a reference, so nothing can be reading or writing the pipes past this point
+		if(atomic_fetch_sub(&device->refCount, 1) > 1) return;
+		
+		if(device->open) {
+			if(device->interfaceHandle) (*device->interfaceHandle)->USBInterfaceClose(device->interfaceHandle);
+			if(device->interfaceHandle) (*device->interfaceHandle)->Release(device->interfaceHandle);
+			if(device->deviceHandle) (*device->deviceHandle)->USBDeviceClose(device->deviceHandle);
+			if(device->deviceHandle) (*device->deviceHandle)->Release(device->deviceHandle);
+		}
+		if(device->usbService) IOObjectRelease(device->usbService);
+		device->open = 0;
+		
+		bufferPoolRelease(device->buffers);
+		if(device->receiveBuffer) free(device->receiveBuffer);
+		
+		pthread_mutex_destroy(&device->lock);
+		pthread_mutex_destroy(&device->writeLock);
+		pthread_cond_destroy(&device->incoming);
+		
+		free(device);
+	}
+}
+
+uint16_t iUSBNormalDeviceGetPID(iUSBNormalDeviceRef device) {
+	if(device == NULL)
+		return 0;
+	
+	return device->idProduct;
+}
+
+CFStringRef iUSBNormalDeviceCopyUDID(iUSBNormalDeviceRef device) {
+	if(device == NULL || !device->usbService)
+		return NULL;
+	
+	return IORegistryEntryCreateCFProperty(device->usbService, CFSTR(kUSBSerialNumberString), kCFAllocatorDefault, 0);
+}
+
+iUSBNormalConnectionRef iUSBNormalConnectionCreate(iUSBNormalDeviceRef device, uint16_t port, UInt32 timeout) {
+	if(device == NULL || !normalDeviceIsOpen(device))
+		return NULL;
+	
+	iUSBNormalConnectionRef newConnection = calloc(1, sizeof(struct __iUSBNormalConnection));
+	newConnection->device = iUSBNormalDeviceRetain(device);
+	newConnection->dport = port;
+	newConnection->state = kNormalConnecting;
+	newConnection->received = CFDataCreateMutable(kCFAllocatorDefault, 0);
+	
+	pthread_mutex_lock(&device->lock);
+	if(device->nextPort == 0) device->nextPort = 1;
+	newConnection->sport = device->nextPort++;
+	newConnection->next = device->connections;
+	device->connections = newConnection;
+	pthread_mutex_unlock(&device->lock);
+	
+	if(!normalSendTCP(newConnection, kMuxTCPSYN, NULL, 0)) {
+		iUSBNormalConnectionRelease(newConnection);
+		return NULL;
+	}
+	
+	CFAbsoluteTime deadline = CFAbsoluteTimeGetCurrent() + (timeout / 1000.0);
+	while(normalConnectionGetState(newConnection) == kNormalConnecting && normalDeviceIsOpen(device)) {
+		UInt32 timeLeft = normalTimeLeft(deadline);
+		if(timeLeft == 0) break;
+		normalPump(device, timeLeft);
+	}
+	
+	if(normalConnectionGetState(newConnection) != kNormalConnected) {
+		iUSBNormalConnectionRelease(newConnection);
+		return NULL;
+	}
+	
+	return newConnection;
+}
+
+Boolean iUSBNormalConnectionSend(iUSBNormalConnectionRef connection, const void *data, UInt32 length, UInt32 timeout) {
+	if(connection == NULL || connection->device == NULL || data == NULL)
+		return 0;
+	
+	iUSBNormalDeviceRef device = connection->device;
+	CFAbsoluteTime deadline = CFAbsoluteTimeGetCurrent() + (timeout / 1000.0);
+	const unsigned char *bytes = data;
+	
+	while(length > 0) {
+		// never put more in flight than the device said it has room for
+		pthread_mutex_lock(&device->lock);
+		int state = connection->state;
+		uint32_t inFlight = connection->txSeq - connection->txAcked;
+		uint32_t room = (connection->txWindow > inFlight ? connection->txWindow - inFlight : 0);
+		pthread_mutex_unlock(&device->lock);
+		
+		if(state != kNormalConnected)
+			return 0;
+		
+		if(room == 0) {
+			UInt32 timeLeft = normalTimeLeft(deadline);
+			if(timeLeft == 0) return 0;
+			normalPump(device, timeLeft);
+			continue;
+		}
+		
+		uint32_t size = length;
+		if(size > room) size = room;
+		if(size > kNormalMaxPayload) size = kNormalMaxPayload;
+		
+		if(!normalSendTCP(connection, kMuxTCPACK, bytes, size))
+			return 0;
+		
+		bytes += size;
+		length -= size;
+	}
+	
+	return 1;
+}
+
+CFIndex iUSBNormalConnectionReceive(iUSBNormalConnectionRef connection, void *buf, CFIndex length, UInt32 timeout) {
+	if(connection == NULL || connection->device == NULL || buf == NULL)
+		return -1;
+	
+	iUSBNormalDeviceRef device = connection->device;
+	CFAbsoluteTime deadline = CFAbsoluteTimeGetCurrent() + (timeout / 1000.0);
+	
+	pthread_mutex_lock(&device->lock);
+	while(CFDataGetLength(connection->received) == 0) {
+		if(connection->state != kNormalConnected || !device->open) {
+			pthread_mutex_unlock(&device->lock);
+			return -1;
+		}
+		
+		UInt32 timeLeft = normalTimeLeft(deadline);
+		if(timeLeft == 0) {
+			pthread_mutex_unlock(&device->lock);
+			return 0;
+		}
+		
+		pthread_mutex_unlock(&device->lock);
+		normalPump(device, timeLeft);
+		pthread_mutex_lock(&device->lock);
+	}
+	
+	CFIndex buffered = CFDataGetLength(connection->received);
+	CFIndex size = (buffered < length ? buffered : length);
+	memcpy(buf, CFDataGetBytePtr(connection->received), size);
+	CFDataDeleteBytes(connection->received, CFRangeMake(0, size));
+	pthread_mutex_unlock(&device->lock);
+	
+	// the window we advertised was at most half open, so tell the device it has room again
+	if(buffered >= kNormalReceiveWindow / 2 && buffered - size < kNormalReceiveWindow / 2) {
+		normalSendTCP(connection, kMuxTCPACK, NULL, 0);
+	}
+	
+	return size;
+}
+
+void iUSBNormalConnectionRelease(iUSBNormalConnectionRef connection) {
+	if(connection != NULL) {
+		iUSBNormalDeviceRef device = connection->device;
+		if(device != NULL) {
+			if(normalConnectionGetState(connection) != kNormalClosed) normalSendTCP(connection, kMuxTCPRST, NULL, 0);
+			
+			pthread_mutex_lock(&device->lock);
+			struct __iUSBNormalConnection **link = &device->connections;
+			while(*link != NULL && *link != connection) link = &(*link)->next;
+			if(*link != NULL) *link = connection->next;
+			pthread_mutex_unlock(&device->lock);
+			
+			iUSBNormalDeviceRelease(device);
+		}
+		
+		CFRelease(connection->received);
+		free(connection);
+	}
+}
+
+HIDDEN iUSBNormalDeviceRef createNormalDevice(uint16_t pid, io_service_t service) {
+	iUSBNormalDeviceRef newDevice = calloc(1, sizeof(struct __iUSBNormalDevice));
+	atomic_init(&newDevice->refCount, 1);
+	newDevice->idProduct = pid;
+	newDevice->usbService = service;
+	IORegistryEntryGetRegistryEntryID(service, &newDevice->registryID);
+	
+	pthread_mutexattr_t attributes;
+	pthread_mutexattr_init(&attributes);
+	pthread_mutexattr_settype(&attributes, PTHREAD_MUTEX_RECURSIVE);
+	pthread_mutex_init(&newDevice->lock, &attributes);
+	pthread_mutexattr_destroy(&attributes);
+	pthread_mutex_init(&newDevice->writeLock, NULL);
+	pthread_cond_init(&newDevice->incoming, NULL);
+	newDevice->buffers = bufferPoolCreate(kNormalBufferSize);
+	
+	// room for the unfinished tail of one mux packet plus a whole read behind it
+	newDevice->receiveBuffer = malloc(kNormalMaxPacketSize + kNormalBufferSize);
+	if(newDevice->receiveBuffer == NULL) {
+		iUSBNormalDeviceRelease(newDevice);
+		return NULL;
+	}
+	
+	if(!normalDeviceOpen(newDevice)) {
+		iUSBNormalDeviceRelease(newDevice);
+		return NULL;
+	}
+	
+	return newDevice;
+}
+
+HIDDEN Boolean normalDeviceMatchesService(iUSBNormalDeviceRef device, io_service_t service) {
+	uint64_t registryID;
+	if(IORegistryEntryGetRegistryEntryID(service, &registryID) != KERN_SUCCESS)
+		return 0;
+	
+	return (registryID == device->registryID ? 1 : 0);
+}
+
+// marks the device gone so waiters give up; the handles stay until the last reference is released
+HIDDEN void normalDeviceClose(iUSBNormalDeviceRef device) {
+	pthread_mutex_lock(&device->lock);
+	device->open = 0;
+	
+	struct __iUSBNormalConnection *connection;
+	for(connection = device->connections; connection != NULL; connection = connection->next) {
+		connection->state = kNormalClosed;
+	}
+	
+	pthread_cond_broadcast(&device->incoming);
+	pthread_mutex_unlock(&device->lock);
+}
+
+HIDDEN Boolean normalDeviceOpen(iUSBNormalDeviceRef device) {
+	IOCFPlugInInterface **pluginInterface;
+	IOUSBDeviceInterface **deviceHandle;
+	
+	SInt32 score;
+	if(IOCreatePlugInInterfaceForService(device->usbService, kIOUSBDeviceUserClientTypeID, kIOCFPlugInInterfaceID, &pluginInterface, &score) != 0) {
+		return 0;
+	}
+	
+	if((*pluginInterface)->QueryInterface(pluginInterface, CFUUIDGetUUIDBytes(kIOUSBDeviceInterfaceID), (LPVOID *)&deviceHandle) != 0) {
+		(*pluginInterface)->Release(pluginInterface);
+		return 0;
+	}
+	
+	(*pluginInterface)->Release(pluginInterface);
+	
+	if((*deviceHandle)->USBDeviceOpen(deviceHandle) != 0) {
+		(*deviceHandle)->Release(deviceHandle);
+		return 0;
+	}
+	
+	device->deviceHandle = deviceHandle;
+	device->open = 1;
+	
+	// the mux interface lives in a configuration of its own on newer devices, so look through them all
+	UInt8 current = 0, configurations = 0;
+	(*deviceHandle)->GetConfiguration(deviceHandle, &current);
+	(*deviceHandle)->GetNumberOfConfigurations(deviceHandle, &configurations);
+	
+	Boolean found = (current != 0 && normalDeviceFindMuxInterface(device));
+	UInt8 config;
+	for(config = configurations; !found && config > 0; --config) {
+		if(config == current) continue;
+		if((*deviceHandle)->SetConfiguration(deviceHandle, config) != 0) continue;
+		found = normalDeviceFindMuxInterface(device);
+	}
+	
+	if(!found)
+		return 0;
+	
+	struct __iUSBMuxVersion version;
+	version.major = htonl(1);
+	version.minor = htonl(0);
+	version.padding = 0;
+	
+	if(!normalSendPacket(device, kMuxProtocolVersion, &version, sizeof(version), NULL, 0))
+		return 0;
+	
+	CFAbsoluteTime deadline = CFAbsoluteTimeGetCurrent() + 1.0;
+	while(device->muxVersion == 0 && normalDeviceIsOpen(device)) {
+		UInt32 timeLeft = normalTimeLeft(deadline);
+		if(timeLeft == 0) break;
+		normalPump(device, timeLeft);
+	}
+	
+	return (device->muxVersion != 0 ? 1 : 0);
+}
+
+HIDDEN Boolean normalDeviceFindMuxInterface(iUSBNormalDeviceRef device) {
+	IOUSBDeviceInterface **deviceHandle = device->deviceHandle;
+	IOUSBInterfaceInterface182 **interfaceHandle;
+	
+	io_iterator_t iterator;
+	IOUSBFindInterfaceRequest interfaceRequest;
+	
+	interfaceRequest.bInterfaceClass = 0xFF;
+	interfaceRequest.bInterfaceSubClass = 0xFE;
+	interfaceRequest.bInterfaceProtocol = 0x02;
+	interfaceRequest.bAlternateSetting = kIOUSBFindInterfaceDontCare;
+	
+	if((*deviceHandle)->CreateInterfaceIterator(deviceHandle, &interfaceRequest, &iterator) != 0) {
+		return 0;
+	}
+	
+	io_service_t usbInterface;
+	Boolean found = 0;
+	while(!found && (usbInterface = IOIteratorNext(iterator))) {
+		IOCFPlugInInterface **iodev;
+		
+		SInt32 score;
+		if(IOCreatePlugInInterfaceForService(usbInterface, kIOUSBInterfaceUserClientTypeID, kIOCFPlugInInterfaceID, &iodev, &score) != 0) {
+			IOObjectRelease(usbInterface);
+			continue;
+		}
+		IOObjectRelease(usbInterface);
+		
+		if((*iodev)->QueryInterface(iodev, CFUUIDGetUUIDBytes(kIOUSBInterfaceInterfaceID182), (LPVOID)&interfaceHandle) != 0) {
+			(*iodev)->Release(iodev);
+			continue;
+		}
+		(*iodev)->Release(iodev);
+		
+		if((*interfaceHandle)->USBInterfaceOpen(interfaceHandle) != 0) {
+			(*interfaceHandle)->Release(interfaceHandle);
+			continue;
+		}
+		
+		UInt8 pipes, in = 0, out = 0;
+		UInt16 outMaxPacketSize = 0;
+		(*interfaceHandle)->GetNumEndpoints(interfaceHandle, &pipes);
+		
+		UInt8 i;
+		for(i = 1; i <= pipes; ++i) {
+			UInt8 direction, number, transferType, interval;
+			UInt16 maxPacketSize;
+			
+			(*interfaceHandle)->GetPipeProperties(interfaceHandle, i, &direction, &number, &transferType, &maxPacketSize, &interval);
+			if(transferType != kUSBBulk) continue;
+			
+			if(direction == kUSBIn && in == 0) {
+				in = i;
+			} else if(direction == kUSBOut && out == 0) {
+				out = i;
+				outMaxPacketSize = maxPacketSize;
+			}
+		}
+		
+		if(in == 0 || out == 0) {
+			(*interfaceHandle)->USBInterfaceClose(interfaceHandle);
+			(*interfaceHandle)->Release(interfaceHandle);
+			continue;
+		}
+		
+		device->interfaceHandle = interfaceHandle;
+		device->inPipeRef = in;
+		device->outPipeRef = out;
+		device->outMaxPacketSize = outMaxPacketSize;
+		found = 1;
+	}
+	IOObjectRelease(iterator);
+	
+	return found;
+}
+
+HIDDEN Boolean normalSendPacket(iUSBNormalDeviceRef device, uint32_t protocol, const void *header, size_t headerLength, const void *payload, size_t payloadLength) {
+	size_t total = sizeof(struct __iUSBMuxHeader) + headerLength + payloadLength;
+	if(!normalDeviceIsOpen(device) || total > kNormalBufferSize)
+		return 0;
+	
+	unsigned char *buf = bufferPoolGet(device->buffers);
+	if(buf == NULL)
+		return 0;
+	
+	struct __iUSBMuxHeader *muxHeader = (struct __iUSBMuxHeader *)buf;
+	muxHeader->protocol = htonl(protocol);
+	muxHeader->length = htonl((uint32_t)total);
+	memcpy(&buf[sizeof(struct __iUSBMuxHeader)], header, headerLength);
+	if(payloadLength) memcpy(&buf[sizeof(struct __iUSBMuxHeader) + headerLength], payload, payloadLength);
+	
+	pthread_mutex_lock(&device->writeLock);
+	IOReturn result = traceWritePipe(device->interfaceHandle, device->registryID, device->outPipeRef, buf, (UInt32)total, 1000, 5000);
+	
+	// a packet that fills its last usb packet exactly needs a zero length packet to end it
+	if(result == kIOReturnSuccess && device->outMaxPacketSize && (total % device->outMaxPacketSize) == 0) {
+		result = traceWritePipe(device->interfaceHandle, device->registryID, device->outPipeRef, buf, 0, 1000, 5000);
+	}
+	pthread_mutex_unlock(&device->writeLock);
+	
+	bufferPoolPut(device->buffers, buf);
+	
+	return (result == kIOReturnSuccess ? 1 : 0);
+}
+
+HIDDEN Boolean normalSendTCP(iUSBNormalConnectionRef connection, uint8_t flags, const void *payload, size_t payloadLength) {
+	iUSBNormalDeviceRef device = connection->device;
+	struct __iUSBMuxTCPHeader header;
+	
+	pthread_mutex_lock(&device->lock);
+	normalBuildTCPHeader(connection, flags, payloadLength, &header);
+	pthread_mutex_unlock(&device->lock);
+	
+	return normalSendPacket(device, kMuxProtocolTCP, &header, sizeof(header), payload, payloadLength);
+}
+
+// called with the device lock held
+HIDDEN void normalBuildTCPHeader(iUSBNormalConnectionRef connection, uint8_t flags, size_t payloadLength, struct __iUSBMuxTCPHeader *header) {
+	CFIndex buffered = CFDataGetLength(connection->received);
+	uint32_t window = (buffered < kNormalReceiveWindow ? kNormalReceiveWindow - buffered : 0);
+	
+	memset(header, 0, sizeof(struct __iUSBMuxTCPHeader));
+	header->sport = htons(connection->sport);
+	header->dport = htons(connection->dport);
+	header->seq = htonl(connection->txSeq);
+	header->ack = htonl(connection->rxSeq);
+	header->offset = (sizeof(struct __iUSBMuxTCPHeader) / 4) << 4;
+	header->flags = flags;
+	header->window = htons(window >> 8);
+	
+	connection->txSeq += payloadLength;
+}
+
+HIDDEN Boolean normalDeviceIsOpen(iUSBNormalDeviceRef device) {
+	pthread_mutex_lock(&device->lock);
+	Boolean open = device->open;
+	pthread_mutex_unlock(&device->lock);
+	
+	return open;
+}
+
+HIDDEN int normalConnectionGetState(iUSBNormalConnectionRef connection) {
+	iUSBNormalDeviceRef device = connection->device;
+	
+	pthread_mutex_lock(&device->lock);
+	int state = connection->state;
+	pthread_mutex_unlock(&device->lock);
+	
+	return state;
+}
+
+HIDDEN void normalPump(iUSBNormalDeviceRef device, UInt32 timeout) {
+	pthread_mutex_lock(&device->lock);
+	
+	// only one thread reads the pipe at a time; everyone else waits for it to hand out what it read
+	if(device->pumping) {
+		struct timeval now;
+		struct timespec until;
+		gettimeofday(&now, NULL);
+		until.tv_sec = now.tv_sec + (timeout / 1000);
+		until.tv_nsec = (now.tv_usec * 1000) + ((timeout % 1000) * 1000000);
+		if(until.tv_nsec >= 1000000000) {
+			until.tv_sec++;
+			until.tv_nsec -= 1000000000;
+		}
+		
+		pthread_cond_timedwait(&device->incoming, &device->lock, &until);
+		pthread_mutex_unlock(&device->lock);
+		return;
+	}
+	
+	device->pumping = 1;
+	pthread_mutex_unlock(&device->lock);
+	
+	normalReadPacket(device, timeout);
+	
+	pthread_mutex_lock(&device->lock);
+	device->pumping = 0;
+	pthread_cond_broadcast(&device->incoming);
+	pthread_mutex_unlock(&device->lock);
+}
+
+HIDDEN void normalReadPacket(iUSBNormalDeviceRef device, UInt32 timeout) {
+	unsigned char *buf = bufferPoolGet(device->buffers);
+	if(buf == NULL)
+		return;
+	
+	UInt32 size = kNormalBufferSize;
+	
+	IOReturn result = traceReadPipe(device->interfaceHandle, device->registryID, device->inPipeRef, buf, &size, timeout, timeout);
+	if(result != kIOReturnSuccess) {
+		if(result != kIOReturnTimeout) {
+			(*device->interfaceHandle)->ClearPipeStallBothEnds(device->interfaceHandle, device->inPipeRef);
+			if(result == kIOReturnNoDevice) {
+				pthread_mutex_lock(&device->lock);
+				device->open = 0;
+				pthread_mutex_unlock(&device->lock);
+			}
+		}
+		bufferPoolPut(device->buffers, buf);
+		return;
+	}
+	
+	// a mux packet can span several reads and a read can end partway into the next packet,
+	// so reads are collected here and only whole packets are handed out
+	memcpy(&device->receiveBuffer[device->receiveLength], buf, size);
+	device->receiveLength += size;
+	bufferPoolPut(device->buffers, buf);
+	
+	size_t offset = 0;
+	while(device->receiveLength - offset >= sizeof(struct __iUSBMuxHeader)) {
+		const struct __iUSBMuxHeader *muxHeader = (const struct __iUSBMuxHeader *)&device->receiveBuffer[offset];
+		size_t length = ntohl(muxHeader->length);
+		
+		// a length no device sends means we've lost our place in the stream, so drop what we have
+		if(length < sizeof(struct __iUSBMuxHeader) || length > kNormalMaxPacketSize) {
+			offset = device->receiveLength;
+			break;
+		}
+		
+		if(device->receiveLength - offset < length)
+			break;
+		
+		normalDispatchPacket(device, &device->receiveBuffer[offset], length);
+		offset += length;
+	}
+	
+	if(offset > 0) {
+		memmove(device->receiveBuffer, &device->receiveBuffer[offset], device->receiveLength - offset);
+		device->receiveLength -= offset;
+	}
+}
+
+HIDDEN void normalDispatchPacket(iUSBNormalDeviceRef device, const unsigned char *packet, size_t length) {
+	const struct __iUSBMuxHeader *muxHeader = (const struct __iUSBMuxHeader *)packet;
+	
+	switch(ntohl(muxHeader->protocol)) {
+		case kMuxProtocolVersion:
+			if(length >= sizeof(struct __iUSBMuxHeader) + sizeof(struct __iUSBMuxVersion)) {
+				const struct __iUSBMuxVersion *version = (const struct __iUSBMuxVersion *)&packet[sizeof(struct __iUSBMuxHeader)];
+				device->muxVersion = ntohl(version->major);
+			}
+			break;
+		case kMuxProtocolTCP:
+			normalHandleTCP(device, &packet[sizeof(struct __iUSBMuxHeader)], length - sizeof(struct __iUSBMuxHeader));
+			break;
+	}
+}
+
+HIDDEN void normalHandleTCP(iUSBNormalDeviceRef device, const unsigned char *packet, size_t length) {
+	if(length < sizeof(struct __iUSBMuxTCPHeader))
+		return;
+	
+	const struct __iUSBMuxTCPHeader *header = (const struct __iUSBMuxTCPHeader *)packet;
+	const unsigned char *payload = &packet[sizeof(struct __iUSBMuxTCPHeader)];
+	size_t payloadLength = length - sizeof(struct __iUSBMuxTCPHeader);
+	uint16_t port = ntohs(header->dport);
+	struct __iUSBMuxTCPHeader ack;
+	Boolean sendAck = 0;
+	
+	pthread_mutex_lock(&device->lock);
+	
+	struct __iUSBNormalConnection *connection = device->connections;
+	while(connection != NULL && connection->sport != port) connection = connection->next;
+	
+	if(connection != NULL) {
+		connection->txAcked = ntohl(header->ack);
+		connection->txWindow = ntohs(header->window) << 8;
+		
+		if(header->flags & kMuxTCPRST) {
+			connection->state = kNormalClosed;
+		} else if(connection->state == kNormalConnecting) {
+			if(header->flags == (kMuxTCPSYN | kMuxTCPACK)) {
+				connection->txSeq++;
+				connection->rxSeq = ntohl(header->seq) + 1;
+				connection->state = kNormalConnected;
+				sendAck = 1;
+			} else {
+				connection->state = kNormalClosed;
+			}
+		} else if(payloadLength > 0) {
+			CFDataAppendBytes(connection->received, payload, payloadLength);
+			connection->rxSeq += payloadLength;
+			sendAck = 1;
+		}
+		
+		// the ack is built while the connection can't be released underneath us
+		if(sendAck) normalBuildTCPHeader(connection, kMuxTCPACK, 0, &ack);
+		
+		if(header->flags & kMuxTCPFIN) connection->state = kNormalClosed;
+	}
+	
+	pthread_mutex_unlock(&device->lock);
+	
+	// but written after the lock is dropped, so a stalled write doesn't hold up every other connection
+	if(sendAck) normalSendPacket(device, kMuxProtocolTCP, &ack, sizeof(ack), NULL, 0);
+}
+
+HIDDEN UInt32 normalTimeLeft(CFAbsoluteTime deadline) {
+	CFAbsoluteTime now = CFAbsoluteTimeGetCurrent();
+	if(now >= deadline) return 0;
+	
+	UInt32 timeLeft = (UInt32)((deadline - now) * 1000.0);
+	return (timeLeft == 0 ? 1 : timeLeft);
+}
\ No newline at end of file
@@ -10,6 +10,100 @@
 #ifndef IUSBCOMM_NORMAL_H
 #define IUSBCOMM_NORMAL_H
 
+#include <CoreFoundation/CoreFoundation.h>
 
+typedef struct __iUSBNormalDevice *iUSBNormalDeviceRef;
+typedef struct __iUSBNormalConnection *iUSBNormalConnectionRef;
+
+/*!
+ @enum iUSBNormalPIDRange
+ @field kUSBPIDNormalFirst - the lowest idProduct used by devices booted into the OS
+ @field kUSBPIDNormalLast - the highest idProduct used by devices booted into the OS
+ */
+enum iUSBNormalPIDRange {
+	kUSBPIDNormalFirst = 0x1290,
+	kUSBPIDNormalLast = 0x12AF
+};
+
+/*!
+ @typedef iUSBNormalDeviceConnectionChangeCallback
+ @param device - The device whose state has changed
+ @param newConnectionState - The new state of the connection. See @enum iUSBRecoveryConnectionState
+ */
+typedef void (*iUSBNormalDeviceConnectionChangeCallback)(iUSBNormalDeviceRef device, uint8_t newConnectionState);
+
+/*!
+ @function iUSBNormalDeviceRetain
+ Take an extra reference on the device object, e.g. before handing it to another thread.
+ @param device - The device to retain.
+ @result The device given.
+ */
+iUSBNormalDeviceRef iUSBNormalDeviceRetain(iUSBNormalDeviceRef device);
+
+/*!
+ @function iUSBNormalDeviceRelease
+ Release a reference to the device object. Each connection holds a reference of its own, so the 
+ device is only disconnected and deallocated once its last connection has been released too.
+ @param device - The device to release.
+ */
+void iUSBNormalDeviceRelease(iUSBNormalDeviceRef device);
+
+/*!
+ @function iUSBNormalDeviceGetPID
+ Returns the PID of the device given.
+ @param device - The device to return the idProduct field of.
+ @result The idProduct of the given device.
+ */
+uint16_t iUSBNormalDeviceGetPID(iUSBNormalDeviceRef device);
+
+/*!
+ @function iUSBNormalDeviceCopyUDID
+ Returns the UDID of the device given, which is its USB serial number.
+ @param device - The device to return the UDID of.
+ @result A CFStringRef object which is the UDID. The caller is responsible for deallocating this.
+ */
+CFStringRef iUSBNormalDeviceCopyUDID(iUSBNormalDeviceRef device);
+
+/*!
+ @function iUSBNormalConnectionCreate
+ Open a stream to a TCP port on the device, multiplexed with any other streams over the device's
+ usbmux interface.
+ @param device - The device to connect to.
+ @param port - The port on the device to connect to. ex: 62078 for lockdownd
+ @param timeout - Time in milliseconds to wait for the device to accept the connection.
+ @result A new connection object which the caller is responsible for releasing, or NULL if the
+ device refused the connection or did not answer.
+ */
+iUSBNormalConnectionRef iUSBNormalConnectionCreate(iUSBNormalDeviceRef device, uint16_t port, UInt32 timeout);
+
+/*!
+ @function iUSBNormalConnectionSend
+ Send data over a connection. Large buffers are split into packets as big as the device accepts,
+ and sending waits for the device's receive window when it is full.
+ @param connection - The connection to send over.
+ @param data - The data to send.
+ @param length - The length of data.
+ @param timeout - Time in milliseconds to wait for the device to open its window before giving up.
+ @result A boolean value, stating whether all of the data was sent.
+ */
+Boolean iUSBNormalConnectionSend(iUSBNormalConnectionRef connection, const void *data, UInt32 length, UInt32 timeout);
+
+/*!
+ @function iUSBNormalConnectionReceive
+ Read data that the device has sent over a connection.
+ @param connection - The connection to read from.
+ @param buf - The buffer to read into.
+ @param length - The size of buf.
+ @param timeout - Time in milliseconds to wait for data if none is buffered.
+ @result The number of bytes read, 0 if the timeout ran out, or -1 if the connection is closed.
+ */
+CFIndex iUSBNormalConnectionReceive(iUSBNormalConnectionRef connection, void *buf, CFIndex length, UInt32 timeout);
+
+/*!
+ @function iUSBNormalConnectionRelease
+ Close the connection and deallocate it.
+ @param connection - The connection to close.
+ */
+void iUSBNormalConnectionRelease(iUSBNormalConnectionRef connection);
 
 #endif /* IUSBCOMM_NORMAL_H */
\ No newline at end of file
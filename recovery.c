@@ -10,30 +10,139 @@
 #include "recovery.h"
 #include "helper.h"
 
+#include <fcntl.h>
+#include <limits.h>
+#include <unistd.h>
+#include <pthread.h>
 #include <sys/stat.h>
+#include <stdatomic.h>
 #include <IOKit/IOKitLib.h>
 #include <IOKit/IOCFPlugIn.h>
 #include <IOKit/usb/IOUSBLib.h>
 #include <CoreFoundation/CoreFoundation.h>
 
+#define kRecoveryBufferSize 0x1000
+#define kRecoveryPacketSize 0x800
+
+enum iUSBRecoveryAsyncType {
+	kAsyncCommand,
+	kAsyncControl,
+	kAsyncUpload,
+	kAsyncResponse
+};
+
+enum iUSBRecoveryAsyncPipe {
+	kAsyncPipeControl = 0,
+	kAsyncPipeBulk = 1
+};
+
+enum iUSBRecoveryAsyncUploadStep {
+	kAsyncUploadPacket,
+	kAsyncUploadStatus,
+	kAsyncUploadEnd
+};
+
+struct __iUSBRecoveryUpload {
+	const unsigned char *buf;
+	int file;
+	size_t length;
+	size_t total;
+	unsigned int packets;
+	uint32_t crc;
+	unsigned char suffix[16];
+	unsigned char *packet;
+};
+
+struct __iUSBRecoveryAsyncRequest {
+	iUSBRecoveryDeviceRef device;
+	int type;
+	int pipe;
+	Boolean started;
+	Boolean inFlight;
+	Boolean aborted;
+	CFRunLoopSourceRef retiredSource;
+	IOUSBDeviceInterface **retiredDevice;
+	IOUSBInterfaceInterface **retiredInterface;
+	IOUSBDevRequest request;
+	char *buffer;
+	UInt32 noDataTimeout;
+	UInt32 completionTimeout;
+	struct __iUSBRecoveryUpload upload;
+	unsigned int current;
+	int step;
+	char status;
+	int file;
+	size_t fileLength;
+	iUSBRecoveryDeviceTransferProgressCallback progressCallback;
+	iUSBRecoveryDeviceCompletionCallback callback;
+	void *context;
+	struct __iUSBRecoveryAsyncRequest *next;
+};
+
 struct __iUSBRecoveryDevice {
-	uint16_t idProduct;
+	_Atomic int32_t refCount;
+	pthread_mutex_t controlLock;
+	pthread_mutex_t bulkLock;
+	_Atomic uint16_t idProduct;
 	io_service_t usbService;
+	uint64_t registryID;
+	uint64_t ecid;
+	UInt32 locationID;
 	IOUSBDeviceInterface **deviceHandle;
 	IOUSBInterfaceInterface **interfaceHandle;
 	UInt8 responsePipeRef;
 	CFDictionaryRef properties;
-	Boolean open;
+	_Atomic Boolean open;
+	Boolean replay;
 	iUSBRecoveryDeviceConnectionChangeCallback disconnectCallback;
 	IONotificationPortRef disconnectNPort;
+	int disconnectDescriptor;
+	mach_port_t disconnectPortSet;
+	io_iterator_t disconnectIterator;
+	iUSBBufferPoolRef buffers;
+	pthread_mutex_t asyncLock;
+	pthread_cond_t asyncIdle;
+	int asyncBlocked[2];
+	Boolean asyncHeld;
+	CFRunLoopRef asyncRunLoop;
+	CFStringRef asyncRunLoopMode;
+	CFRunLoopSourceRef asyncSources[2];
+	struct __iUSBRecoveryAsyncRequest *asyncQueues[2];
+	struct {
+		Boolean complete;
+		UInt32 length;
+		UInt32 crc;
+	} lastTransfer;
 };
 
 size_t _recoveryDeviceSize = sizeof(struct __iUSBRecoveryDevice);
 
 HIDDEN int deviceGetStatus(iUSBRecoveryDeviceRef device, int flag);
+HIDDEN Boolean deviceSendBuffer(iUSBRecoveryDeviceRef device, const unsigned char *buf, int file, size_t length, iUSBRecoveryDeviceTransferProgressCallback progressCallback);
+HIDDEN Boolean deviceSendBufferLocked(iUSBRecoveryDeviceRef device, const unsigned char *buf, int file, size_t length, unsigned char *packet, iUSBRecoveryDeviceTransferProgressCallback progressCallback);
+HIDDEN void uploadBegin(iUSBRecoveryDeviceRef device, struct __iUSBRecoveryUpload *upload, const unsigned char *buf, int file, size_t length, unsigned char *packet);
+HIDDEN Boolean uploadPreparePacket(iUSBRecoveryDeviceRef device, struct __iUSBRecoveryUpload *upload, unsigned int current, IOUSBDevRequest *request);
+HIDDEN CFStringRef deviceCreateResponse(char *buf, UInt32 size);
+HIDDEN struct __iUSBRecoveryAsyncRequest *deviceAsyncRequestCreate(iUSBRecoveryDeviceRef device, int type, iUSBRecoveryDeviceCompletionCallback callback, void *context);
+HIDDEN Boolean deviceAsyncEnqueue(iUSBRecoveryDeviceRef device, struct __iUSBRecoveryAsyncRequest *request);
+HIDDEN void deviceAsyncRun(iUSBRecoveryDeviceRef device, int pipe);
+HIDDEN IOReturn deviceAsyncStart(struct __iUSBRecoveryAsyncRequest *request);
+HIDDEN void deviceAsyncCompleted(void *refCon, IOReturn result, void *arg0);
+HIDDEN IOReturn deviceAsyncSend(struct __iUSBRecoveryAsyncRequest *request);
+HIDDEN void deviceAsyncFinish(struct __iUSBRecoveryAsyncRequest *request, Boolean success, UInt32 lengthDone, CFStringRef response);
+HIDDEN void deviceAsyncComplete(struct __iUSBRecoveryAsyncRequest *request, Boolean success, UInt32 lengthDone, CFStringRef response);
+HIDDEN void deviceAddAsyncSources(iUSBRecoveryDeviceRef device);
+HIDDEN Boolean deviceLockPipe(iUSBRecoveryDeviceRef device, pthread_mutex_t *lock);
+HIDDEN Boolean deviceHoldPipe(iUSBRecoveryDeviceRef device, pthread_mutex_t *lock);
+HIDDEN void deviceUnlockPipe(iUSBRecoveryDeviceRef device, pthread_mutex_t *lock);
+HIDDEN void deviceScheduleDisconnectNotification(iUSBRecoveryDeviceRef device, iUSBRecoveryDeviceNotificationContext *context);
+HIDDEN Boolean serviceIsRecoveryDevice(io_service_t service, uint16_t *pid);
 HIDDEN Boolean deviceOpen(iUSBRecoveryDeviceRef device, CFMutableDictionaryRef matching);
 HIDDEN void deviceDisconnected(void *refCon, io_iterator_t iterator);
 HIDDEN iUSBRecoveryDeviceRef createRecoveryDevice(uint16_t pid, io_service_t service);
+HIDDEN void deviceClose(iUSBRecoveryDeviceRef device, Boolean keepQueued);
+HIDDEN Boolean deviceReattach(iUSBRecoveryDeviceRef device, uint16_t pid, io_service_t service);
+HIDDEN Boolean deviceMatchesService(iUSBRecoveryDeviceRef device, io_service_t service);
 
 iUSBRecoveryDeviceRef iUSBRecoveryDeviceCreate(uint16_t pid, iUSBRecoveryDeviceNotificationContext *context) {
 	CFMutableDictionaryRef matching = IOServiceMatching(kIOUSBDeviceClassName);
@@ -52,73 +161,232 @@ iUSBRecoveryDeviceRef iUSBRecoveryDeviceCreate(uint16_t pid, iUSBRecoveryDeviceN
 	CFRetain(matching);
 	
 	io_service_t usbService = IOServiceGetMatchingService(kIOMasterPortDefault, matching);
-	if(!usbService) 
+	if(!usbService) {
+		CFRelease(matching);
 		return NULL;
+	}
 	
-	iUSBRecoveryDeviceRef newDevice = calloc(1, _recoveryDeviceSize);
-	newDevice->idProduct = pid;
-	newDevice->usbService = usbService;
+	iUSBRecoveryDeviceRef newDevice = createRecoveryDevice(pid, usbService);
 	
 	if(!deviceOpen(newDevice, matching)) {
-		free(newDevice);
+		CFRelease(matching);
+		iUSBRecoveryDeviceRelease(newDevice);
 		return NULL;
 	}
 	
-	if(context != NULL) {
-		if(context->disconnectCallback != NULL) {
-			CFRunLoopSourceRef notifySource = IONotificationPortGetRunLoopSource(newDevice->disconnectNPort);
-			
-			newDevice->disconnectCallback = context->disconnectCallback;
-			if(context->runLoop != NULL) {
-				if(context->runLoopMode != NULL) {
-					CFRunLoopAddSource(context->runLoop, notifySource, context->runLoopMode);
-				} else {
-					CFRunLoopAddSource(context->runLoop, notifySource, kCFRunLoopDefaultMode);
-				}
-			} else {
-				if(context->runLoopMode != NULL) {
-					CFRunLoopAddSource(CFRunLoopGetCurrent(), notifySource, context->runLoopMode);
-				} else {
-					CFRunLoopAddSource(CFRunLoopGetCurrent(), notifySource, kCFRunLoopDefaultMode);
-				}
+	deviceScheduleDisconnectNotification(newDevice, context);
+	
+	return newDevice;
+}
+
+iUSBRecoveryDeviceRef iUSBRecoveryDeviceCreateReplay(uint64_t deviceID, uint16_t pid) {
+	if(!traceReplayActive())
+		return NULL;
+	
+	// there's nothing to find or open; every transfer is answered from the trace's records for deviceID
+	iUSBRecoveryDeviceRef newDevice = createRecoveryDevice(pid, 0);
+	newDevice->registryID = deviceID;
+	newDevice->replay = 1;
+	atomic_store(&newDevice->open, 1);
+	
+	return newDevice;
+}
+
+CFIndex iUSBRecoveryDeviceEnumerate(iUSBRecoveryDeviceDescriptor **descriptors) {
+	if(descriptors == NULL)
+		return -1;
+	
+	*descriptors = NULL;
+	
+	CFMutableDictionaryRef matching = IOServiceMatching(kIOUSBDeviceClassName);
+	if(matching == NULL) 
+		return -1;
+	
+	CFNumberRef idVendor = AppleIncVendorID();
+	CFDictionarySetValue(matching, CFSTR(kUSBVendorID), (const void *)idVendor);
+	CFRelease(idVendor);
+	
+	// one pass over every apple device on the bus; the pids are filtered here rather than matched one by one
+	io_iterator_t iterator;
+	if(IOServiceGetMatchingServices(kIOMasterPortDefault, matching, &iterator) != KERN_SUCCESS) 
+		return -1;
+	
+	CFIndex count = 0, capacity = 0;
+	io_service_t service;
+	while(service = IOIteratorNext(iterator)) {
+		uint16_t pid;
+		if(!serviceIsRecoveryDevice(service, &pid)) {
+			IOObjectRelease(service);
+			continue;
+		}
+		
+		if(count == capacity) {
+			capacity = (capacity ? capacity * 2 : 4);
+			iUSBRecoveryDeviceDescriptor *grown = realloc(*descriptors, capacity * sizeof(iUSBRecoveryDeviceDescriptor));
+			if(grown == NULL) {
+				IOObjectRelease(service);
+				IOObjectRelease(iterator);
+				iUSBRecoveryDeviceDescriptorsRelease(*descriptors, count);
+				*descriptors = NULL;
+				return -1;
 			}
+			*descriptors = grown;
+		}
+		
+		iUSBRecoveryDeviceDescriptor *descriptor = &(*descriptors)[count++];
+		memset(descriptor, 0, sizeof(iUSBRecoveryDeviceDescriptor));
+		descriptor->pid = pid;
+		IORegistryEntryGetRegistryEntryID(service, &descriptor->registryID);
+		
+		CFNumberRef locationID = IORegistryEntryCreateCFProperty(service, CFSTR(kUSBDevicePropertyLocationID), kCFAllocatorDefault, 0);
+		if(locationID != NULL) {
+			CFNumberGetValue(locationID, kCFNumberSInt32Type, &descriptor->locationID);
+			CFRelease(locationID);
 		}
+		
+		descriptor->serialNumber = IORegistryEntryCreateCFProperty(service, CFSTR(kUSBSerialNumberString), kCFAllocatorDefault, 0);
+		descriptor->ecid = ecidFromSerialNumber(descriptor->serialNumber);
+		
+		IOObjectRelease(service);
+	}
+	IOObjectRelease(iterator);
+	
+	return count;
+}
+
+void iUSBRecoveryDeviceDescriptorsRelease(iUSBRecoveryDeviceDescriptor *descriptors, CFIndex count) {
+	if(descriptors == NULL)
+		return;
+	
+	CFIndex i;
+	for(i = 0; i < count; ++i) {
+		if(descriptors[i].serialNumber) CFRelease(descriptors[i].serialNumber);
+	}
+	
+	free(descriptors);
+}
+
+iUSBRecoveryDeviceRef iUSBRecoveryDeviceCreateWithDescriptor(const iUSBRecoveryDeviceDescriptor *descriptor, iUSBRecoveryDeviceNotificationContext *context) {
+	if(descriptor == NULL)
+		return NULL;
+	
+	CFMutableDictionaryRef matching = IORegistryEntryIDMatching(descriptor->registryID);
+	if(matching == NULL) 
+		return NULL;
+	
+	CFRetain(matching);
+	
+	io_service_t usbService = IOServiceGetMatchingService(kIOMasterPortDefault, matching);
+	if(!usbService) {
+		CFRelease(matching);
+		return NULL;
 	}
 	
+	iUSBRecoveryDeviceRef newDevice = createRecoveryDevice(descriptor->pid, usbService);
+	
+	if(!deviceOpen(newDevice, matching)) {
+		CFRelease(matching);
+		iUSBRecoveryDeviceRelease(newDevice);
+		return NULL;
+	}
+	
+	deviceScheduleDisconnectNotification(newDevice, context);
+	
 	return newDevice;
 }
 
+iUSBRecoveryDeviceRef iUSBRecoveryDeviceRetain(iUSBRecoveryDeviceRef device) {
+	if(device != NULL) atomic_fetch_add(&device->refCount, 1);
+	
+	return device;
+}
+
 void iUSBRecoveryDeviceRelease(iUSBRecoveryDeviceRef device) {
 	if(device != NULL) {
-		if(device->open) {
-			if(device->deviceHandle) (*device->deviceHandle)->USBDeviceClose(device->deviceHandle);
-			if(device->deviceHandle) (*device->deviceHandle)->Release(device->deviceHandle);
-			if(device->interfaceHandle) (*device->interfaceHandle)->USBInterfaceClose(device->interfaceHandle);
-			if(device->interfaceHandle) (*device->interfaceHandle)->Release(device->interfaceHandle);
-			if(device->properties) CFRelease(device->properties);
-			if(device->disconnectNPort) IONotificationPortDestroy(device->disconnectNPort);
-		}
-		if(device->usbService) IOObjectRelease(device->usbService);
-		device->open = 0;
+		if(atomic_fetch_sub(&device->refCount, 1) > 1) return;
+		
+		deviceClose(device, 0);
+		pthread_mutex_destroy(&device->controlLock);
+		pthread_mutex_destroy(&device->bulkLock);
+		pthread_mutex_destroy(&device->asyncLock);
+		pthread_cond_destroy(&device->asyncIdle);
+		bufferPoolRelease(device->buffers);
+		
+		if(device->asyncRunLoop) CFRelease(device->asyncRunLoop);
+		if(device->asyncRunLoopMode) CFRelease(device->asyncRunLoopMode);
 		
 		free(device);
 	}
 }
 
+int iUSBRecoveryDeviceGetEventDescriptor(iUSBRecoveryDeviceRef device, iUSBRecoveryDeviceConnectionChangeCallback disconnectCallback) {
+	if(device == NULL || disconnectCallback == NULL || !device->open)
+		return -1;
+	
+	device->disconnectCallback = disconnectCallback;
+	if(device->disconnectDescriptor < 0) {
+		device->disconnectDescriptor = notificationPortCreateDescriptor(device->disconnectNPort, &device->disconnectPortSet);
+	}
+	
+	return device->disconnectDescriptor;
+}
+
+int iUSBRecoveryDeviceProcessEvents(iUSBRecoveryDeviceRef device) {
+	if(device == NULL || device->disconnectDescriptor < 0)
+		return 0;
+	
+	// the disconnect callback is allowed to release the device, so hold it until dispatch is done
+	iUSBRecoveryDeviceRetain(device);
+	int dispatched = notificationPortDispatch(device->disconnectNPort, device->disconnectPortSet);
+	iUSBRecoveryDeviceRelease(device);
+	
+	return dispatched;
+}
+
 uint16_t iUSBRecoveryDeviceGetPID(iUSBRecoveryDeviceRef device) {
 	if(device == NULL) 
 		return 0;
 	
-	return device->idProduct;
+	return atomic_load(&device->idProduct);
+}
+
+uint64_t iUSBRecoveryDeviceGetECID(iUSBRecoveryDeviceRef device) {
+	if(device == NULL) 
+		return 0;
+	
+	return device->ecid;
+}
+
+UInt32 iUSBRecoveryDeviceGetLocationID(iUSBRecoveryDeviceRef device) {
+	if(device == NULL) 
+		return 0;
+	
+	return device->locationID;
+}
+
+Boolean iUSBRecoveryDeviceIsConnected(iUSBRecoveryDeviceRef device) {
+	if(device == NULL) 
+		return 0;
+	
+	// the listener closes and reattaches devices from its own thread
+	return atomic_load(&device->open);
 }
 
 Boolean iUSBRecoveryDeviceSendCommand(iUSBRecoveryDeviceRef device, CFStringRef command) {
-	if(device == NULL || command == NULL || !device->open || !iUSBRecoveryDeviceIsInRecoveryMode(device))
+	if(device == NULL || command == NULL || !iUSBRecoveryDeviceIsInRecoveryMode(device))
+		return 0;
+	
+	if(!deviceLockPipe(device, &device->controlLock))
 		return 0;
 	
+	// iboot's own command line is far shorter than one buffer, so longer commands can't be meant for it
 	int bufsize = (CFStringGetLength(command)+1);
-	char *cmdBuf = calloc(1, bufsize);
-	CFStringGetCString(command, cmdBuf, bufsize, kCFStringEncodingUTF8);
+	char *cmdBuf = bufferPoolGet(device->buffers);
+	if(cmdBuf == NULL || bufsize > kRecoveryBufferSize || !CFStringGetCString(command, cmdBuf, bufsize, kCFStringEncodingUTF8)) {
+		deviceUnlockPipe(device, &device->controlLock);
+		bufferPoolPut(device->buffers, cmdBuf);
+		return 0;
+	}
 	
 	IOUSBDevRequest request;
 	request.bmRequestType = kUSBRequestCommand;
@@ -131,13 +399,14 @@ Boolean iUSBRecoveryDeviceSendCommand(iUSBRecoveryDeviceRef device, CFStringRef
 	
 	Boolean retVal;
 	
-	if((*device->deviceHandle)->DeviceRequest(device->deviceHandle, &request) != kIOReturnSuccess) {
+	if(traceDeviceRequest(device->deviceHandle, device->registryID, &request) != kIOReturnSuccess) {
 		retVal = 0;
 	} else {
 		retVal = 1;
 	}
 	
-	free(cmdBuf);
+	deviceUnlockPipe(device, &device->controlLock);
+	bufferPoolPut(device->buffers, cmdBuf);
 	
 	return retVal;
 }
@@ -146,189 +415,676 @@ Boolean iUSBRecoveryDeviceSendFile(iUSBRecoveryDeviceRef device, CFStringRef fil
 	if(device == NULL || filePath == NULL || !device->open)
 		return 0;
 	
-	int bufsize = (CFStringGetLength(filePath) + 1);
-	char path[bufsize];
-	CFStringGetCString(filePath, path, bufsize, kCFStringEncodingUTF8);
+	char path[PATH_MAX];
+	if(!CFStringGetFileSystemRepresentation(filePath, path, sizeof(path)))
+		return 0;
+	
+	int file = open(path, O_RDONLY);
+	if(file < 0)
+		return 0;
+	
+	Boolean retVal = iUSBRecoveryDeviceSendFileDescriptor(device, file, progressCallback);
+	close(file);
+	
+	return retVal;
+}
+
+Boolean iUSBRecoveryDeviceSendFileDescriptor(iUSBRecoveryDeviceRef device, int file, iUSBRecoveryDeviceTransferProgressCallback progressCallback) {
+	if(device == NULL || file < 0 || !device->open)
+		return 0;
 	
-	unsigned char *buf;
-	unsigned int packet_size = 0x800;
 	struct stat check;
+	if(fstat(file, &check) != 0 || check.st_size == 0)
+		return 0;
 	
-	if(stat(path, &check) != 0) {
+	// each packet is read as it's sent rather than mapped, so a file that is cut short fails the upload instead of faulting
+	return deviceSendBuffer(device, NULL, file, check.st_size, progressCallback);
+}
+
+Boolean iUSBRecoveryDeviceSendData(iUSBRecoveryDeviceRef device, CFDataRef data, iUSBRecoveryDeviceTransferProgressCallback progressCallback) {
+	if(device == NULL || data == NULL || !device->open)
 		return 0;
+	
+	return deviceSendBuffer(device, CFDataGetBytePtr(data), -1, CFDataGetLength(data), progressCallback);
+}
+
+CFStringRef iUSBRecoveryDeviceReadResponse(iUSBRecoveryDeviceRef device, UInt32 noDataTimeout, UInt32 completionTimout) {
+	if(device == NULL || !iUSBRecoveryDeviceIsInRecoveryMode(device))
+		return NULL;
+	
+	UInt32 buf_size = 0x800;
+	char *buf = bufferPoolGet(device->buffers);
+	if(buf == NULL)
+		return NULL;
+	
+	if(!deviceLockPipe(device, &device->bulkLock)) {
+		bufferPoolPut(device->buffers, buf);
+		return NULL;
 	}
 	
-	buf = malloc(check.st_size);
-	memset(buf, '\0', check.st_size);
+	IOReturn result = traceReadPipe((IOUSBInterfaceInterface182 **)device->interfaceHandle, device->registryID, device->responsePipeRef, buf, &buf_size, noDataTimeout, completionTimout);
+	deviceUnlockPipe(device, &device->bulkLock);
+	
+	CFStringRef response = (result == kIOReturnSuccess ? deviceCreateResponse(buf, buf_size) : NULL);
+	bufferPoolPut(device->buffers, buf);
+	
+	return response;
+}
+
+Boolean iUSBRecoveryDeviceSendControlMessage(iUSBRecoveryDeviceRef device, UInt8 bmRequestType, UInt8 bRequest, UInt16 wValue, UInt16 wIndex, UInt16 wLength, void *pData, UInt32 wLenDone) {
+	if(device == NULL || !deviceLockPipe(device, &device->controlLock))
+		return 0;
+	
+	IOUSBDevRequest request;
+	request.bmRequestType = bmRequestType;
+	request.bRequest = bRequest;
+	request.wValue = wValue;
+	request.wIndex = wIndex;
+	request.wLength = wLength;
+	request.pData = pData;
+	request.wLenDone = wLenDone;
+	
+	IOReturn result = traceDeviceRequest(device->deviceHandle, device->registryID, &request);
+	deviceUnlockPipe(device, &device->controlLock);
 	
-	FILE *file = fopen(path, "r");
-	if(file == NULL) {
+	return (result == kIOReturnSuccess ? 1 : 0);
+}
+
+Boolean iUSBRecoveryDeviceScheduleWithRunLoop(iUSBRecoveryDeviceRef device, CFRunLoopRef runLoop, CFStringRef runLoopMode) {
+	if(device == NULL || device->asyncRunLoop != NULL)
+		return 0;
+	
+	device->asyncRunLoop = (CFRunLoopRef)CFRetain(runLoop ? runLoop : CFRunLoopGetCurrent());
+	device->asyncRunLoopMode = CFRetain(runLoopMode ? runLoopMode : kCFRunLoopDefaultMode);
+	
+	// hold the pipes so the device can't be closed while its sources are added; a closed one gets them when it reopens
+	pthread_mutex_lock(&device->controlLock);
+	pthread_mutex_lock(&device->bulkLock);
+	deviceAddAsyncSources(device);
+	pthread_mutex_unlock(&device->bulkLock);
+	pthread_mutex_unlock(&device->controlLock);
+	
+	return 1;
+}
+
+Boolean iUSBRecoveryDeviceSendCommandAsync(iUSBRecoveryDeviceRef device, CFStringRef command, iUSBRecoveryDeviceCompletionCallback callback, void *context) {
+	if(device == NULL || command == NULL || device->asyncRunLoop == NULL || !iUSBRecoveryDeviceIsInRecoveryMode(device))
+		return 0;
+	
+	struct __iUSBRecoveryAsyncRequest *request = deviceAsyncRequestCreate(device, kAsyncCommand, callback, context);
+	if(request == NULL)
+		return 0;
+	
+	int bufsize = (CFStringGetLength(command)+1);
+	if(bufsize > kRecoveryBufferSize || !CFStringGetCString(command, request->buffer, bufsize, kCFStringEncodingUTF8)) {
+		bufferPoolPut(device->buffers, request->buffer);
+		free(request);
 		return 0;
 	}
 	
-	if(fread((void *)buf, check.st_size, 1, file) == 0) {
-		fclose(file);
-		free(buf);
+	request->request.bmRequestType = kUSBRequestCommand;
+	request->request.bRequest = 0x0;
+	request->request.wValue = 0x0;
+	request->request.wIndex = 0x0;
+	request->request.wLength = (UInt16)bufsize;
+	request->request.pData = (void *)request->buffer;
+	request->request.wLenDone = 0x0;
+	
+	return deviceAsyncEnqueue(device, request);
+}
+
+Boolean iUSBRecoveryDeviceSendFileAsync(iUSBRecoveryDeviceRef device, CFStringRef filePath, iUSBRecoveryDeviceTransferProgressCallback progressCallback, iUSBRecoveryDeviceCompletionCallback callback, void *context) {
+	if(device == NULL || filePath == NULL || device->asyncRunLoop == NULL)
+		return 0;
+	
+	char path[PATH_MAX];
+	if(!CFStringGetFileSystemRepresentation(filePath, path, sizeof(path)))
+		return 0;
+	
+	struct stat check;
+	int file = open(path, O_RDONLY);
+	if(file < 0)
+		return 0;
+	
+	struct __iUSBRecoveryAsyncRequest *request = NULL;
+	if(fstat(file, &check) != 0 || check.st_size == 0 || (request = deviceAsyncRequestCreate(device, kAsyncUpload, callback, context)) == NULL) {
+		close(file);
 		return 0;
 	}
 	
-	fclose(file);
+	request->file = file;
+	request->fileLength = check.st_size;
+	request->progressCallback = progressCallback;
+	
+	return deviceAsyncEnqueue(device, request);
+}
+
+Boolean iUSBRecoveryDeviceReadResponseAsync(iUSBRecoveryDeviceRef device, UInt32 noDataTimeout, UInt32 completionTimeout, iUSBRecoveryDeviceCompletionCallback callback, void *context) {
+	if(device == NULL || device->asyncRunLoop == NULL || !iUSBRecoveryDeviceIsInRecoveryMode(device))
+		return 0;
+	
+	struct __iUSBRecoveryAsyncRequest *request = deviceAsyncRequestCreate(device, kAsyncResponse, callback, context);
+	if(request == NULL)
+		return 0;
+	
+	request->noDataTimeout = noDataTimeout;
+	request->completionTimeout = completionTimeout;
+	
+	return deviceAsyncEnqueue(device, request);
+}
+
+Boolean iUSBRecoveryDeviceSendControlMessageAsync(iUSBRecoveryDeviceRef device, UInt8 bmRequestType, UInt8 bRequest, UInt16 wValue, UInt16 wIndex, UInt16 wLength, void *pData, iUSBRecoveryDeviceCompletionCallback callback, void *context) {
+	if(device == NULL || device->asyncRunLoop == NULL)
+		return 0;
+	
+	struct __iUSBRecoveryAsyncRequest *request = deviceAsyncRequestCreate(device, kAsyncControl, callback, context);
+	if(request == NULL)
+		return 0;
+	
+	request->request.bmRequestType = bmRequestType;
+	request->request.bRequest = bRequest;
+	request->request.wValue = wValue;
+	request->request.wIndex = wIndex;
+	request->request.wLength = wLength;
+	request->request.pData = pData;
+	request->request.wLenDone = 0x0;
+	
+	return deviceAsyncEnqueue(device, request);
+}
+
+Boolean iUSBRecoveryDeviceIsInRecoveryMode(iUSBRecoveryDeviceRef device) {
+	return (atomic_load(&device->idProduct) == kUSBPIDRecovery ? 1 : 0);
+}
+
+void iUSBRecoveryDeviceReboot(iUSBRecoveryDeviceRef device) {
+	iUSBRecoveryDeviceSendCommand(device, CFSTR("reboot"));
+}
+
+Boolean iUSBRecoveryDeviceReset(iUSBRecoveryDeviceRef device) {
+	if(device == NULL || !deviceLockPipe(device, &device->controlLock))
+		return 0;
+	
+	// the device leaves the bus during either call, so only the reset itself is checked
+	IOReturn result = (device->deviceHandle != NULL ? (*device->deviceHandle)->ResetDevice(device->deviceHandle) : kIOReturnNotOpen);
+	if(result == kIOReturnSuccess) (*device->deviceHandle)->USBDeviceReEnumerate(device->deviceHandle, 0);
+	
+	deviceUnlockPipe(device, &device->controlLock);
+	
+	return (result == kIOReturnSuccess ? 1 : 0);
+}
+
+void iUSBRecoveryDeviceSetAutoBoot(iUSBRecoveryDeviceRef device, Boolean autoBoot) {
+	iUSBRecoveryDeviceSendCommand(device, (autoBoot ? CFSTR("setenv auto-boot true") : CFSTR("setenv auto-boot false")));
+	iUSBRecoveryDeviceSendCommand(device, CFSTR("saveenv"));
+}
+
+UInt32 iUSBRecoveryDeviceGetLastTransferCRC32(iUSBRecoveryDeviceRef device) {
+	// an upload on another thread rewrites lastTransfer while it holds the control pipe
+	if(device == NULL || !deviceHoldPipe(device, &device->controlLock))
+		return 0;
+	
+	UInt32 crc = (device->lastTransfer.complete ? device->lastTransfer.crc : 0);
+	deviceUnlockPipe(device, &device->controlLock);
+	
+	return crc;
+}
+
+Boolean iUSBRecoveryDeviceVerifyLastTransfer(iUSBRecoveryDeviceRef device) {
+	if(device == NULL || !deviceLockPipe(device, &device->controlLock))
+		return 0;
+	
+	Boolean complete = device->lastTransfer.complete;
+	UInt32 length = device->lastTransfer.length;
 	
-	unsigned int packets, current;
-	packets = (check.st_size / packet_size);
-	if(check.st_size % packet_size) {
-		packets++;
+	// a dfu device can't be asked, so all there is to go on is that it got through every status poll
+	if(!complete || !iUSBRecoveryDeviceIsInRecoveryMode(device)) {
+		deviceUnlockPipe(device, &device->controlLock);
+		return complete;
 	}
 	
-	for(current = 0; current < packets; ++current) {
-		int size = (current + 1 < packets ? packet_size : (check.st_size % packet_size));
-		
-		IOUSBDevRequest file_request;
-		
-		file_request.bmRequestType = kUSBRequestFile;
-		file_request.bRequest = 0x1;
-		file_request.wValue = current;
-		file_request.wIndex = 0x0;
-		file_request.wLength = (UInt16)size;
-		file_request.pData = (void *)&buf[current * packet_size];
-		file_request.wLenDone = 0x0;
+	char *value = bufferPoolGet(device->buffers);
+	Boolean retVal = 0;
+	
+	// iboot answers getenv on the control pipe; the bulk pipe is console output and may hold anything
+	if(value != NULL && iUSBRecoveryDeviceSendCommand(device, CFSTR("getenv filesize"))) {
+		IOUSBDevRequest request;
+		request.bmRequestType = 0xC0;
+		request.bRequest = 0x0;
+		request.wValue = 0x0;
+		request.wIndex = 0x0;
+		request.wLength = 0xFF;
+		request.pData = (void *)value;
+		request.wLenDone = 0x0;
 		
-		if((*device->deviceHandle)->DeviceRequest(device->deviceHandle, &file_request) != kIOReturnSuccess) {
-			free(buf);
+		if(traceDeviceRequest(device->deviceHandle, device->registryID, &request) == kIOReturnSuccess && request.wLenDone > 0) {
+			value[request.wLenDone < 0xFF ? request.wLenDone : 0xFF] = '\0';
+			retVal = (strtoul(value, NULL, 0) == length ? 1 : 0);
+		}
+	}
+	
+	deviceUnlockPipe(device, &device->controlLock);
+	bufferPoolPut(device->buffers, value);
+	
+	return retVal;
+}
+
+// called with the control lock held
+HIDDEN int deviceGetStatus(iUSBRecoveryDeviceRef device, int flag) { 
+	if(!device->open)
+		return -1;
+	
+	IOUSBDevRequest status_request;
+	char *response = bufferPoolGet(device->buffers);
+	if(response == NULL)
+		return -1;
+	
+	status_request.bmRequestType = kUSBRequestStatus;
+	status_request.bRequest = 0x3;
+	status_request.wValue = 0x0;
+	status_request.wIndex = 0x0;
+	status_request.wLength = 0x6;
+	status_request.pData = (void *)response;
+	status_request.wLenDone = 0x0;
+	
+	int retVal = 0;
+	if(traceDeviceRequest(device->deviceHandle, device->registryID, &status_request) != kIOReturnSuccess || response[4] != flag) {
+		retVal = -1;
+	}
+	
+	bufferPoolPut(device->buffers, response);
+	
+	return retVal;
+}
+
+// sends length bytes from buf, or when buf is NULL, from the start of file
+HIDDEN Boolean deviceSendBuffer(iUSBRecoveryDeviceRef device, const unsigned char *buf, int file, size_t length, iUSBRecoveryDeviceTransferProgressCallback progressCallback) {
+	// the whole upload holds the control pipe so nobody else's requests land between its packets
+	unsigned char *packet = bufferPoolGet(device->buffers);
+	if(packet == NULL)
+		return 0;
+	
+	if(!deviceLockPipe(device, &device->controlLock)) {
+		bufferPoolPut(device->buffers, packet);
+		return 0;
+	}
+	
+	Boolean retVal = deviceSendBufferLocked(device, buf, file, length, packet, progressCallback);
+	deviceUnlockPipe(device, &device->controlLock);
+	bufferPoolPut(device->buffers, packet);
+	
+	return retVal;
+}
+
+HIDDEN Boolean deviceSendBufferLocked(iUSBRecoveryDeviceRef device, const unsigned char *buf, int file, size_t length, unsigned char *packet, iUSBRecoveryDeviceTransferProgressCallback progressCallback) {
+	struct __iUSBRecoveryUpload upload;
+	uploadBegin(device, &upload, buf, file, length, packet);
+	
+	IOUSBDevRequest file_request;
+	unsigned int current;
+	for(current = 0; current < upload.packets; ++current) {
+		if(!uploadPreparePacket(device, &upload, current, &file_request) || traceDeviceRequest(device->deviceHandle, device->registryID, &file_request) != kIOReturnSuccess) {
 			return 0;
 		}
 		
 		if(deviceGetStatus(device, 5) != 0) {
-			free(buf);
 			return 0;
 		}
 	
 		if(progressCallback)  {
-			float progress = (((current + 1) * 100) / packets);
+			float progress = (((current + 1) * 100) / upload.packets);
 			progressCallback(progress);
 		}
 	}
 	
-	IOUSBDevRequest checkup;
-	checkup.bmRequestType = kUSBRequestFile;
-	checkup.bRequest = 0x1;
-	checkup.wValue = current;
-	checkup.wIndex = 0x0;
-	checkup.wLength = 0x0;
-	checkup.pData = buf;
-	checkup.wLenDone = 0x0;
+	if(!uploadPreparePacket(device, &upload, current, &file_request))
+		return 0;
 	
-	(*device->deviceHandle)->DeviceRequest(device->deviceHandle, &checkup);
+	traceDeviceRequest(device->deviceHandle, device->registryID, &file_request);
 	
 	for(current = 6; current < 8; ++current) {
 		if(deviceGetStatus(device, current) != 0) {
-			free(buf);
 			return 0;
 		}
 	}
 	
-	free(buf);
+	device->lastTransfer.complete = 1;
 	
 	return 1;
 }
 
-CFStringRef iUSBRecoveryDeviceReadResponse(iUSBRecoveryDeviceRef device, UInt32 noDataTimeout, UInt32 completionTimout) {
-	if(device == NULL || !device->open || !iUSBRecoveryDeviceIsInRecoveryMode(device))
-		return NULL;
+HIDDEN void uploadBegin(iUSBRecoveryDeviceRef device, struct __iUSBRecoveryUpload *upload, const unsigned char *buf, int file, size_t length, unsigned char *packet) {
+	// dfu images get the standard 16 byte suffix, whose crc the device checks before manifesting
+	static const unsigned char suffix[16] = {
+		0xFF, 0xFF, 0xFF, 0xFF, 0xAC, 0x05, 0x00, 0x01, 'U', 'F', 'D', 0x10,
+		0x00, 0x00, 0x00, 0x00
+	};
+	memcpy(upload->suffix, suffix, sizeof(suffix));
 	
-	UInt32 buf_size = 0x800;
-	char buf[buf_size];
+	upload->buf = buf;
+	upload->file = file;
+	upload->length = length;
+	upload->total = length + (iUSBRecoveryDeviceIsInRecoveryMode(device) ? 0 : sizeof(suffix));
+	upload->packet = packet;
+	upload->crc = 0xFFFFFFFF;
 	
-	if(((IOUSBInterfaceInterface182 *)(*device->interfaceHandle))->ReadPipeTO(device->interfaceHandle, device->responsePipeRef, buf, &buf_size, noDataTimeout, completionTimout) != 0)
-		return NULL;
+	upload->packets = (upload->total / kRecoveryPacketSize);
+	if(upload->total % kRecoveryPacketSize) {
+		upload->packets++;
+	}
+	
+	device->lastTransfer.complete = 0;
+	device->lastTransfer.length = (UInt32)length;
+}
+
+// packets must be prepared in order; current == packets gives the empty packet that ends the upload
+HIDDEN Boolean uploadPreparePacket(iUSBRecoveryDeviceRef device, struct __iUSBRecoveryUpload *upload, unsigned int current, IOUSBDevRequest *request) {
+	size_t length = upload->length;
+	size_t offset = (size_t)current * kRecoveryPacketSize;
+	size_t size = (current < upload->packets && upload->total - offset < kRecoveryPacketSize ? upload->total - offset : kRecoveryPacketSize);
+	size_t data_part = (offset >= length ? 0 : (length - offset < size ? length - offset : size));
+	const unsigned char *data = upload->packet;
+	
+	if(current >= upload->packets) {
+		size = 0;
+		if(upload->total == length) device->lastTransfer.crc = upload->crc ^ 0xFFFFFFFF;
+	} else {
+		// files are read a packet at a time into the packet buffer; memory is sent in place unless the suffix spills in
+		if(upload->buf == NULL) {
+			if(data_part > 0 && pread(upload->file, upload->packet, data_part, offset) != (ssize_t)data_part)
+				return 0;
+		} else if(data_part == size) {
+			data = &upload->buf[offset];
+		} else {
+			memcpy(upload->packet, &upload->buf[offset], data_part);
+		}
+		
+		upload->crc = crc32Update(upload->crc, data, data_part);
+		
+		if(data_part < size) {
+			size_t suffix_start = offset + data_part - length;
+			size_t suffix_part = size - data_part;
+			size_t suffix_crc_end = (suffix_start + suffix_part < 12 ? suffix_start + suffix_part : 12);
+			
+			if(suffix_start == 0) device->lastTransfer.crc = upload->crc ^ 0xFFFFFFFF;
+			if(suffix_start < suffix_crc_end) upload->crc = crc32Update(upload->crc, &upload->suffix[suffix_start], suffix_crc_end - suffix_start);
+			if(suffix_start + suffix_part > 12) {
+				upload->suffix[12] = upload->crc & 0xFF;
+				upload->suffix[13] = (upload->crc >> 8) & 0xFF;
+				upload->suffix[14] = (upload->crc >> 16) & 0xFF;
+				upload->suffix[15] = (upload->crc >> 24) & 0xFF;
+			}
+			
+			memcpy(&upload->packet[data_part], &upload->suffix[suffix_start], suffix_part);
+		}
+	}
+	
+	request->bmRequestType = kUSBRequestFile;
+	request->bRequest = 0x1;
+	request->wValue = current;
+	request->wIndex = 0x0;
+	request->wLength = (UInt16)size;
+	request->pData = (void *)data;
+	request->wLenDone = 0x0;
+	
+	return 1;
+}
 
-	if(buf[0] == '\0') return NULL;
+// buf is a pooled buffer holding size bytes read from the response pipe
+HIDDEN CFStringRef deviceCreateResponse(char *buf, UInt32 size) {
+	if(buf[0] == '\0')
+		return NULL;
 	
-	char fixed_buf[buf_size];
+	// the buffer is bigger than the read, so the padding past the response can be zeroed to end the scan
+	memset(&buf[size], '\0', kRecoveryBufferSize - size);
 	
+	// squeeze the nuls out in place; the write position never passes the read position
 	int bi, fi;
-	for(bi = 0, fi = 0; bi < buf_size; ++bi) {
+	for(bi = 0, fi = 0; bi < size; ++bi) {
 		if(buf[bi] == '\0') {
 			if(buf[bi+1] == '\0' && buf[bi+2] == '\0') {
-				fixed_buf[fi] = '\0';
 				break;
 			}
 		} else {
-			fixed_buf[fi] = buf[bi];
+			buf[fi] = buf[bi];
 			fi++;
 		}
 	}
+	buf[fi] = '\0';
 	
-	CFStringRef response = CFStringCreateWithCString(kCFAllocatorDefault, (const char *)fixed_buf, kCFStringEncodingUTF8);
+	return CFStringCreateWithCString(kCFAllocatorDefault, (const char *)buf, kCFStringEncodingUTF8);
+}
+
+HIDDEN struct __iUSBRecoveryAsyncRequest *deviceAsyncRequestCreate(iUSBRecoveryDeviceRef device, int type, iUSBRecoveryDeviceCompletionCallback callback, void *context) {
+	struct __iUSBRecoveryAsyncRequest *newRequest = calloc(1, sizeof(struct __iUSBRecoveryAsyncRequest));
+	newRequest->type = type;
+	newRequest->file = -1;
+	newRequest->pipe = (type == kAsyncResponse ? kAsyncPipeBulk : kAsyncPipeControl);
+	newRequest->callback = callback;
+	newRequest->context = context;
 	
-	return response;
+	// control messages use the caller's buffer; everything else stages its data in a pooled one
+	if(type != kAsyncControl) {
+		newRequest->buffer = bufferPoolGet(device->buffers);
+		if(newRequest->buffer == NULL) {
+			free(newRequest);
+			return NULL;
+		}
+	}
+	
+	return newRequest;
 }
 
-Boolean iUSBRecoveryDeviceSendControlMessage(iUSBRecoveryDeviceRef device, UInt8 bmRequestType, UInt8 bRequest, UInt16 wValue, UInt16 wIndex, UInt16 wLength, void *pData, UInt32 wLenDone) {
-	if(!device->open)
-		return 0;
+HIDDEN Boolean deviceAsyncEnqueue(iUSBRecoveryDeviceRef device, struct __iUSBRecoveryAsyncRequest *request) {
+	request->device = iUSBRecoveryDeviceRetain(device);
+	request->next = NULL;
 	
-	IOUSBDevRequest request;
-	request.bmRequestType = bmRequestType;
-	request.bRequest = bRequest;
-	request.wValue = wValue;
-	request.wIndex = wIndex;
-	request.wLength = wLength;
-	request.pData = pData;
-	request.wLenDone = wLenDone;
+	pthread_mutex_lock(&device->asyncLock);
+	struct __iUSBRecoveryAsyncRequest **link = &device->asyncQueues[request->pipe];
+	while(*link != NULL) link = &(*link)->next;
+	*link = request;
+	pthread_mutex_unlock(&device->asyncLock);
 	
-	if((*device->deviceHandle)->DeviceRequest(device->deviceHandle, &request) != kIOReturnSuccess) {
-		return 0;
-	}
+	deviceAsyncRun(device, request->pipe);
 	
 	return 1;
 }
 
-Boolean iUSBRecoveryDeviceIsInRecoveryMode(iUSBRecoveryDeviceRef device) {
-	return (device->idProduct == kUSBPIDRecovery ? 1 : 0);
+// starts the request at the head of a queue if none is running and no blocking call holds the pipe, failing any that can't be started
+HIDDEN void deviceAsyncRun(iUSBRecoveryDeviceRef device, int pipe) {
+	while(1) {
+		pthread_mutex_lock(&device->asyncLock);
+		struct __iUSBRecoveryAsyncRequest *request = device->asyncQueues[pipe];
+		if(request == NULL || request->started || device->asyncBlocked[pipe] > 0 || device->asyncHeld) {
+			pthread_mutex_unlock(&device->asyncLock);
+			return;
+		}
+		
+		if(deviceAsyncStart(request) == kIOReturnSuccess) {
+			request->started = 1;
+			request->inFlight = 1;
+			pthread_mutex_unlock(&device->asyncLock);
+			return;
+		}
+		
+		device->asyncQueues[pipe] = request->next;
+		pthread_mutex_unlock(&device->asyncLock);
+		
+		deviceAsyncComplete(request, 0, 0, NULL);
+	}
 }
 
-void iUSBRecoveryDeviceReboot(iUSBRecoveryDeviceRef device) {
-	iUSBRecoveryDeviceSendCommand(device, CFSTR("reboot"));
+// called with the async lock held
+HIDDEN IOReturn deviceAsyncStart(struct __iUSBRecoveryAsyncRequest *request) {
+	iUSBRecoveryDeviceRef device = request->device;
+	IOReturn result = kIOReturnNotOpen;
+	
+	// a replayed device has no sources; its completions are scheduled on the run loop directly
+	if(device->open && (device->asyncSources[request->pipe] != NULL || device->replay)) {
+		if(request->type == kAsyncResponse) {
+			result = traceReadPipeAsync((IOUSBInterfaceInterface182 **)device->interfaceHandle, device->registryID, device->responsePipeRef, request->buffer, kRecoveryPacketSize, request->noDataTimeout, request->completionTimeout, deviceAsyncCompleted, request, device->asyncRunLoop, device->asyncRunLoopMode);
+		} else {
+			if(request->type == kAsyncUpload) {
+				uploadBegin(device, &request->upload, NULL, request->file, request->fileLength, (unsigned char *)request->buffer);
+				request->step = kAsyncUploadPacket;
+				if(!uploadPreparePacket(device, &request->upload, request->current, &request->request)) return kIOReturnIOError;
+			}
+			result = traceDeviceRequestAsync(device->deviceHandle, device->registryID, &request->request, deviceAsyncCompleted, request, device->asyncRunLoop, device->asyncRunLoopMode);
+		}
+	}
+	
+	return result;
 }
 
-void iUSBRecoveryDeviceSetAutoBoot(iUSBRecoveryDeviceRef device, Boolean autoBoot) {
-	iUSBRecoveryDeviceSendCommand(device, (autoBoot ? CFSTR("setenv auto-boot true") : CFSTR("setenv auto-boot false")));
-	iUSBRecoveryDeviceSendCommand(device, CFSTR("saveenv"));
+HIDDEN void deviceAsyncCompleted(void *refCon, IOReturn result, void *arg0) {
+	struct __iUSBRecoveryAsyncRequest *request = refCon;
+	iUSBRecoveryDeviceRef device = request->device;
+	
+	pthread_mutex_lock(&device->asyncLock);
+	request->inFlight = 0;
+	Boolean aborted = request->aborted;
+	pthread_mutex_unlock(&device->asyncLock);
+	
+	// deviceClose has given up on it, and this is the abort arriving; all that's left is to report the failure
+	if(aborted) {
+		deviceAsyncFinish(request, 0, 0, NULL);
+		return;
+	}
+	
+	if(request->type == kAsyncResponse) {
+		UInt32 size = (UInt32)(uintptr_t)arg0;
+		CFStringRef response = (result == kIOReturnSuccess ? deviceCreateResponse(request->buffer, size) : NULL);
+		deviceAsyncFinish(request, (response != NULL ? 1 : 0), size, response);
+		return;
+	}
+	
+	if(request->type != kAsyncUpload) {
+		deviceAsyncFinish(request, (result == kIOReturnSuccess ? 1 : 0), request->request.wLenDone, NULL);
+		return;
+	}
+	
+	// uploads walk the same packet, status, packet... sequence as deviceSendBufferLocked, one request per completion
+	switch(request->step) {
+		case kAsyncUploadPacket:
+			if(result != kIOReturnSuccess) {
+				deviceAsyncFinish(request, 0, 0, NULL);
+				return;
+			}
+			request->status = 5;
+			break;
+		case kAsyncUploadEnd:
+			request->status = 6;
+			break;
+		case kAsyncUploadStatus:
+			if(result != kIOReturnSuccess || request->buffer[4] != request->status) {
+				deviceAsyncFinish(request, 0, 0, NULL);
+				return;
+			}
+			
+			if(request->status == 5) {
+				request->current++;
+				if(request->progressCallback) {
+					float progress = ((request->current * 100) / request->upload.packets);
+					request->progressCallback(progress);
+				}
+				
+				request->step = (request->current < request->upload.packets ? kAsyncUploadPacket : kAsyncUploadEnd);
+				if(!uploadPreparePacket(device, &request->upload, request->current, &request->request) || deviceAsyncSend(request) != kIOReturnSuccess) deviceAsyncFinish(request, 0, 0, NULL);
+				return;
+			}
+			
+			if(request->status == 7) {
+				device->lastTransfer.complete = 1;
+				deviceAsyncFinish(request, 1, (UInt32)request->upload.length, NULL);
+				return;
+			}
+			
+			request->status++;
+			break;
+	}
+	
+	request->step = kAsyncUploadStatus;
+	request->request.bmRequestType = kUSBRequestStatus;
+	request->request.bRequest = 0x3;
+	request->request.wValue = 0x0;
+	request->request.wIndex = 0x0;
+	request->request.wLength = 0x6;
+	request->request.pData = (void *)request->buffer;
+	request->request.wLenDone = 0x0;
+	
+	if(deviceAsyncSend(request) != kIOReturnSuccess) deviceAsyncFinish(request, 0, 0, NULL);
 }
 
-HIDDEN int deviceGetStatus(iUSBRecoveryDeviceRef device, int flag) { 
-	if(!device->open)
-		return -1;
+HIDDEN IOReturn deviceAsyncSend(struct __iUSBRecoveryAsyncRequest *request) {
+	iUSBRecoveryDeviceRef device = request->device;
+	IOReturn result = kIOReturnNotOpen;
 	
-	IOUSBDevRequest status_request;
-	char response[6];
+	pthread_mutex_lock(&device->asyncLock);
+	if(device->open && !request->aborted) result = traceDeviceRequestAsync(device->deviceHandle, device->registryID, &request->request, deviceAsyncCompleted, request, device->asyncRunLoop, device->asyncRunLoopMode);
+	if(result == kIOReturnSuccess) request->inFlight = 1;
+	pthread_mutex_unlock(&device->asyncLock);
 	
-	status_request.bmRequestType = kUSBRequestStatus;
-	status_request.bRequest = 0x3;
-	status_request.wValue = 0x0;
-	status_request.wIndex = 0x0;
-	status_request.wLength = 0x6;
-	status_request.pData = (void *)response;
-	status_request.wLenDone = 0x0;
+	return result;
+}
+
+HIDDEN void deviceAsyncFinish(struct __iUSBRecoveryAsyncRequest *request, Boolean success, UInt32 lengthDone, CFStringRef response) {
+	// the request's reference goes with it, and the device is still needed to start the next one
+	iUSBRecoveryDeviceRef device = iUSBRecoveryDeviceRetain(request->device);
+	int pipe = request->pipe;
 	
-	if((*device->deviceHandle)->DeviceRequest(device->deviceHandle, &status_request) != kIOReturnSuccess) {
-		return -1;
-	}
+	// deviceClose takes a running request off the queue but leaves finishing it to us
+	pthread_mutex_lock(&device->asyncLock);
+	Boolean queued = (device->asyncQueues[pipe] == request ? 1 : 0);
+	if(queued) device->asyncQueues[pipe] = request->next;
+	pthread_cond_broadcast(&device->asyncIdle);
+	pthread_mutex_unlock(&device->asyncLock);
 	
-	if(response[4] != flag) {
-		return -1;
+	deviceAsyncComplete(request, success, lengthDone, response);
+	if(queued) deviceAsyncRun(device, pipe);
+	
+	iUSBRecoveryDeviceRelease(device);
+}
+
+HIDDEN void deviceAsyncComplete(struct __iUSBRecoveryAsyncRequest *request, Boolean success, UInt32 lengthDone, CFStringRef response) {
+	if(request->callback != NULL) request->callback(request->device, success, lengthDone, response, request->context);
+	if(response) CFRelease(response);
+	
+	// an aborted request kept alive the source and handle its completion came through until now
+	if(request->retiredSource != NULL) {
+		CFRunLoopRemoveSource(request->device->asyncRunLoop, request->retiredSource, request->device->asyncRunLoopMode);
+		CFRelease(request->retiredSource);
 	}
+	if(request->retiredDevice != NULL) (*request->retiredDevice)->Release(request->retiredDevice);
+	if(request->retiredInterface != NULL) (*request->retiredInterface)->Release(request->retiredInterface);
+	
+	if(request->file >= 0) close(request->file);
+	bufferPoolPut(request->device->buffers, request->buffer);
+	iUSBRecoveryDeviceRelease(request->device);
+	
+	free(request);
+}
+
+HIDDEN void deviceAddAsyncSources(iUSBRecoveryDeviceRef device) {
+	if(device->asyncRunLoop == NULL || !device->open || device->replay)
+		return;
 	
-	return 0;
+	pthread_mutex_lock(&device->asyncLock);
+	if((*device->deviceHandle)->CreateDeviceAsyncEventSource(device->deviceHandle, &device->asyncSources[kAsyncPipeControl]) == kIOReturnSuccess) {
+		CFRunLoopAddSource(device->asyncRunLoop, device->asyncSources[kAsyncPipeControl], device->asyncRunLoopMode);
+	}
+	if(device->interfaceHandle != NULL && (*device->interfaceHandle)->CreateInterfaceAsyncEventSource(device->interfaceHandle, &device->asyncSources[kAsyncPipeBulk]) == kIOReturnSuccess) {
+		CFRunLoopAddSource(device->asyncRunLoop, device->asyncSources[kAsyncPipeBulk], device->asyncRunLoopMode);
+	}
+	pthread_mutex_unlock(&device->asyncLock);
 }
 
 HIDDEN Boolean deviceOpen(iUSBRecoveryDeviceRef device, CFMutableDictionaryRef matching) {
 	IOCFPlugInInterface **pluginInterface;
 	IOUSBDeviceInterface **deviceHandle;
-	IOUSBInterfaceInterface **interfaceHandle;
+	IOUSBInterfaceInterface **interfaceHandle = NULL;
 	
+	// deviceOpen gives up the service on failure, so only hand it back to the device on success
 	io_service_t service = device->usbService;
+	device->usbService = 0;
 	
 	SInt32 score;
 	if(IOCreatePlugInInterfaceForService(service, kIOUSBDeviceUserClientTypeID, kIOCFPlugInInterfaceID, &pluginInterface, &score) != 0) {
@@ -337,6 +1093,7 @@ HIDDEN Boolean deviceOpen(iUSBRecoveryDeviceRef device, CFMutableDictionaryRef m
 	}
 	
 	if((*pluginInterface)->QueryInterface(pluginInterface, CFUUIDGetUUIDBytes(kIOUSBDeviceInterfaceID), (LPVOID *)&deviceHandle) != 0) {
+		(*pluginInterface)->Release(pluginInterface);
 		IOObjectRelease(service);
 		return 0;
 	}
@@ -376,6 +1133,7 @@ HIDDEN Boolean deviceOpen(iUSBRecoveryDeviceRef device, CFMutableDictionaryRef m
 	UInt8 found_interface = 0, index = 0;
 	while(usbInterface = IOIteratorNext(iterator)) {
 		if(index < 1) {
+			IOObjectRelease(usbInterface);
 			index++;
 			continue;
 		}
@@ -413,52 +1171,289 @@ HIDDEN Boolean deviceOpen(iUSBRecoveryDeviceRef device, CFMutableDictionaryRef m
 			(*interfaceHandle)->GetPipeProperties(interfaceHandle, ind, &direction, &number, &transferType, &maxPacketSize, &interval);
 			if(transferType == kUSBBulk && direction == kUSBIn) {
 				found_interface = i;
-				IOObjectRelease(usbInterface);
 				break;
 			}
 		}
 		
 		IOObjectRelease(usbInterface);
+		
+		// keep the first interface with a bulk in pipe open, and don't leave any others open behind it
+		if(found_interface) break;
+		
+		(*interfaceHandle)->USBInterfaceClose(interfaceHandle);
+		(*interfaceHandle)->Release(interfaceHandle);
+		interfaceHandle = NULL;
 	}
 	IOObjectRelease(iterator);
 	
 	CFMutableDictionaryRef properties;
-	IORegistryEntryCreateCFProperties(device->usbService, &properties, kCFAllocatorDefault, 0);
+	IORegistryEntryCreateCFProperties(service, &properties, kCFAllocatorDefault, 0);
 	
+	device->usbService = service;
 	device->deviceHandle = deviceHandle;
 	device->interfaceHandle = interfaceHandle;
-	device->open = 1;
+	atomic_store(&device->open, 1);
 	device->properties = (CFDictionaryRef)properties;
 	device->responsePipeRef = found_interface;
+	
+	// the ecid outlives the properties, so a closed device can still be matched when it comes back
+	uint64_t ecid = ecidFromSerialNumber(CFDictionaryGetValue(device->properties, CFSTR(kUSBSerialNumberString)));
+	if(ecid != 0) device->ecid = ecid;
+	
+	CFNumberRef locationID = CFDictionaryGetValue(device->properties, CFSTR(kUSBDevicePropertyLocationID));
+	if(locationID != NULL) CFNumberGetValue(locationID, kCFNumberSInt32Type, &device->locationID);
 	device->disconnectNPort = IONotificationPortCreate(kIOMasterPortDefault);
 	
 	if(matching) {
-		io_iterator_t detachedIterator;
-		IOServiceAddMatchingNotification(device->disconnectNPort, kIOTerminatedNotification, matching, deviceDisconnected, device, &detachedIterator);
-		deviceDisconnected(device, detachedIterator);
+		if(IOServiceAddMatchingNotification(device->disconnectNPort, kIOTerminatedNotification, matching, deviceDisconnected, device, &device->disconnectIterator) == KERN_SUCCESS) {
+			deviceDisconnected(device, device->disconnectIterator);
+		}
 	}
 	
+	deviceAddAsyncSources(device);
+	
 	return 1;
 }
 
 HIDDEN void deviceDisconnected(void *refCon, io_iterator_t iterator) {
 	iUSBRecoveryDeviceRef device = refCon;
+	Boolean disconnected = 0;
 	io_service_t service;
 	while(service = IOIteratorNext(iterator)) {
 		IOObjectRelease(service);
-		if(device != NULL) {
-			if(device->disconnectCallback != NULL) {
-				IOObjectRelease(iterator);
-				device->disconnectCallback(device, kUSBDisconnected);
-			}
-		}
+		disconnected = 1;
+	}
+	
+	// the iterator belongs to the device and goes away with it, so the callback that may release it comes last
+	if(disconnected && device != NULL && device->disconnectCallback != NULL) {
+		device->disconnectCallback(device, kUSBDisconnected);
 	}
 }
 
 HIDDEN iUSBRecoveryDeviceRef createRecoveryDevice(uint16_t pid, io_service_t service) {
 	iUSBRecoveryDeviceRef newDevice = calloc(1, _recoveryDeviceSize);
-	newDevice->idProduct = pid;
+	atomic_init(&newDevice->refCount, 1);
+	newDevice->disconnectDescriptor = -1;
+	newDevice->buffers = bufferPoolCreate(kRecoveryBufferSize);
+	
+	pthread_mutexattr_t attributes;
+	pthread_mutexattr_init(&attributes);
+	pthread_mutexattr_settype(&attributes, PTHREAD_MUTEX_RECURSIVE);
+	pthread_mutex_init(&newDevice->controlLock, &attributes);
+	pthread_mutex_init(&newDevice->bulkLock, &attributes);
+	pthread_mutexattr_destroy(&attributes);
+	pthread_mutex_init(&newDevice->asyncLock, NULL);
+	pthread_cond_init(&newDevice->asyncIdle, NULL);
+	
+	atomic_init(&newDevice->idProduct, pid);
 	newDevice->usbService = service;
+	IORegistryEntryGetRegistryEntryID(service, &newDevice->registryID);
 	
 	return newDevice;
+}
+
+HIDDEN void deviceClose(iUSBRecoveryDeviceRef device, Boolean keepQueued) {
+	// wait out any transfer in flight on another thread before pulling the handles from under it
+	pthread_mutex_lock(&device->controlLock);
+	pthread_mutex_lock(&device->bulkLock);
+	
+	pthread_mutex_lock(&device->asyncLock);
+	struct __iUSBRecoveryAsyncRequest *failed[2];
+	int i;
+	for(i = 0; i < 2; ++i) {
+		struct __iUSBRecoveryAsyncRequest *request = device->asyncQueues[i];
+		device->asyncQueues[i] = NULL;
+		
+		// a running request belongs to its completion, which closing the handles below delivers as an abort,
+		// so it's only marked here; one in flight keeps the source and handle that abort comes through
+		if(request != NULL && request->started) {
+			request->aborted = 1;
+			if(request->inFlight) {
+				request->retiredSource = device->asyncSources[i];
+				device->asyncSources[i] = NULL;
+				
+				if(i == kAsyncPipeControl) {
+					request->retiredDevice = device->deviceHandle;
+					if(device->deviceHandle) (*device->deviceHandle)->AddRef(device->deviceHandle);
+				} else {
+					request->retiredInterface = device->interfaceHandle;
+					if(device->interfaceHandle) (*device->interfaceHandle)->AddRef(device->interfaceHandle);
+				}
+			}
+			request = request->next;
+		}
+		
+		// requests that never started wait for a reattach if the caller expects one, and are failed below otherwise
+		if(keepQueued) {
+			device->asyncQueues[i] = request;
+			failed[i] = NULL;
+		} else {
+			failed[i] = request;
+		}
+		
+		if(device->asyncSources[i] != NULL) {
+			CFRunLoopRemoveSource(device->asyncRunLoop, device->asyncSources[i], device->asyncRunLoopMode);
+			CFRelease(device->asyncSources[i]);
+			device->asyncSources[i] = NULL;
+		}
+	}
+	device->asyncHeld = keepQueued;
+	pthread_cond_broadcast(&device->asyncIdle);
+	pthread_mutex_unlock(&device->asyncLock);
+	
+	if(device->open) {
+		if(device->deviceHandle) (*device->deviceHandle)->USBDeviceClose(device->deviceHandle);
+		if(device->deviceHandle) (*device->deviceHandle)->Release(device->deviceHandle);
+		if(device->interfaceHandle) (*device->interfaceHandle)->USBInterfaceClose(device->interfaceHandle);
+		if(device->interfaceHandle) (*device->interfaceHandle)->Release(device->interfaceHandle);
+		if(device->properties) CFRelease(device->properties);
+		if(device->disconnectDescriptor >= 0) notificationPortDestroyDescriptor(device->disconnectDescriptor, device->disconnectPortSet);
+		if(device->disconnectIterator) IOObjectRelease(device->disconnectIterator);
+		if(device->disconnectNPort) IONotificationPortDestroy(device->disconnectNPort);
+	}
+	if(device->usbService) IOObjectRelease(device->usbService);
+	
+	device->deviceHandle = NULL;
+	device->interfaceHandle = NULL;
+	device->properties = NULL;
+	device->disconnectNPort = NULL;
+	device->disconnectDescriptor = -1;
+	device->disconnectPortSet = MACH_PORT_NULL;
+	device->disconnectIterator = 0;
+	device->usbService = 0;
+	atomic_store(&device->open, 0);
+	
+	pthread_mutex_unlock(&device->bulkLock);
+	pthread_mutex_unlock(&device->controlLock);
+	
+	for(i = 0; i < 2; ++i) {
+		while(failed[i] != NULL) {
+			struct __iUSBRecoveryAsyncRequest *request = failed[i];
+			failed[i] = request->next;
+			deviceAsyncComplete(request, 0, 0, NULL);
+		}
+	}
+}
+
+HIDDEN Boolean deviceReattach(iUSBRecoveryDeviceRef device, uint16_t pid, io_service_t service) {
+	pthread_mutex_lock(&device->controlLock);
+	pthread_mutex_lock(&device->bulkLock);
+	
+	deviceClose(device, 1);
+	
+	atomic_store(&device->idProduct, pid);
+	device->usbService = service;
+	IORegistryEntryGetRegistryEntryID(service, &device->registryID);
+	
+	Boolean retVal = deviceOpen(device, NULL);
+	
+	pthread_mutex_unlock(&device->bulkLock);
+	pthread_mutex_unlock(&device->controlLock);
+	
+	// requests queued before the device went away pick up where they left off, or fail if it couldn't be reopened
+	if(retVal) {
+		pthread_mutex_lock(&device->asyncLock);
+		device->asyncHeld = 0;
+		pthread_mutex_unlock(&device->asyncLock);
+		
+		deviceAsyncRun(device, kAsyncPipeControl);
+		deviceAsyncRun(device, kAsyncPipeBulk);
+	} else {
+		deviceClose(device, 0);
+	}
+	
+	return retVal;
+}
+
+HIDDEN Boolean deviceLockPipe(iUSBRecoveryDeviceRef device, pthread_mutex_t *lock) {
+	if(!deviceHoldPipe(device, lock))
+		return 0;
+	
+	if(!device->open) {
+		deviceUnlockPipe(device, lock);
+		return 0;
+	}
+	
+	return 1;
+}
+
+// like deviceLockPipe, but for reading the device's own state, which is still there once it has closed
+HIDDEN Boolean deviceHoldPipe(iUSBRecoveryDeviceRef device, pthread_mutex_t *lock) {
+	int pipe = (lock == &device->bulkLock ? kAsyncPipeBulk : kAsyncPipeControl);
+	
+	// an async transfer already running on the pipe, like an upload between packets, has to finish first,
+	// and no queued one may start until we're done. This waits without the pipe lock, so deviceClose can still get in
+	pthread_mutex_lock(&device->asyncLock);
+	while(device->asyncQueues[pipe] != NULL && device->asyncQueues[pipe]->started) {
+		// its completion is delivered on the run loop, so waiting for it there would never end
+		if(device->asyncRunLoop == CFRunLoopGetCurrent()) {
+			pthread_mutex_unlock(&device->asyncLock);
+			return 0;
+		}
+		pthread_cond_wait(&device->asyncIdle, &device->asyncLock);
+	}
+	device->asyncBlocked[pipe]++;
+	pthread_mutex_unlock(&device->asyncLock);
+	
+	pthread_mutex_lock(lock);
+	
+	return 1;
+}
+
+HIDDEN void deviceUnlockPipe(iUSBRecoveryDeviceRef device, pthread_mutex_t *lock) {
+	int pipe = (lock == &device->bulkLock ? kAsyncPipeBulk : kAsyncPipeControl);
+	
+	pthread_mutex_unlock(lock);
+	
+	pthread_mutex_lock(&device->asyncLock);
+	device->asyncBlocked[pipe]--;
+	pthread_mutex_unlock(&device->asyncLock);
+	
+	// anything queued while we held the pipe can go now
+	deviceAsyncRun(device, pipe);
+}
+
+HIDDEN Boolean deviceMatchesService(iUSBRecoveryDeviceRef device, io_service_t service) {
+	uint64_t registryID;
+	if(IORegistryEntryGetRegistryEntryID(service, &registryID) != KERN_SUCCESS)
+		return 0;
+	
+	return (registryID == device->registryID ? 1 : 0);
+}
+
+HIDDEN void deviceScheduleDisconnectNotification(iUSBRecoveryDeviceRef device, iUSBRecoveryDeviceNotificationContext *context) {
+	if(context != NULL) {
+		if(context->disconnectCallback != NULL) {
+			CFRunLoopSourceRef notifySource = IONotificationPortGetRunLoopSource(device->disconnectNPort);
+			
+			device->disconnectCallback = context->disconnectCallback;
+			if(context->runLoop != NULL) {
+				if(context->runLoopMode != NULL) {
+					CFRunLoopAddSource(context->runLoop, notifySource, context->runLoopMode);
+				} else {
+					CFRunLoopAddSource(context->runLoop, notifySource, kCFRunLoopDefaultMode);
+				}
+			} else {
+				if(context->runLoopMode != NULL) {
+					CFRunLoopAddSource(CFRunLoopGetCurrent(), notifySource, context->runLoopMode);
+				} else {
+					CFRunLoopAddSource(CFRunLoopGetCurrent(), notifySource, kCFRunLoopDefaultMode);
+				}
+			}
+		}
+	}
+}
+
+HIDDEN Boolean serviceIsRecoveryDevice(io_service_t service, uint16_t *pid) {
+	CFNumberRef CFPID = IORegistryEntryCreateCFProperty(service, CFSTR(kUSBProductID), kCFAllocatorDefault, 0);
+	if(CFPID == NULL)
+		return 0;
+	
+	uint16_t idProduct = 0;
+	CFNumberGetValue(CFPID, kCFNumberSInt16Type, &idProduct);
+	CFRelease(CFPID);
+	
+	if(pid != NULL) *pid = idProduct;
+	
+	return (idProduct == kUSBPIDRecovery || idProduct == kUSBPIDDFU || idProduct == kUSBPIDWTF ? 1 : 0);
 }
\ No newline at end of file
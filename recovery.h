@@ -44,11 +44,25 @@ typedef void (*iUSBRecoveryDeviceTransferProgressCallback)(Float32 percentComple
 
 /*!
  @typedef iUSBRecoveryDeviceConnectionChangeCallback
- @param device - The device whose state has changed
+ @param device - The device whose state has changed. From a listener that reattaches devices, it is only 
+ guaranteed to stay valid until the callback returns: to keep using it after that, the caller *must* take 
+ its own reference with iUSBRecoveryDeviceRetain and release it when done, since the listener may deallocate 
+ a disconnected device on any later detach.
  @param newConnectionState - The new state of the connection. See @enum iUSBRecoveryConnectionState
  */
 typedef void (*iUSBRecoveryDeviceConnectionChangeCallback)(iUSBRecoveryDeviceRef device, uint8_t newConnectionState);
 
+/*!
+ @typedef iUSBRecoveryDeviceCompletionCallback
+ @param device - The device the request was sent to
+ @param success - Whether the request completed successfully
+ @param lengthDone - The number of bytes moved by the request. For file uploads, the length of the file.
+ @param response - For iUSBRecoveryDeviceReadResponseAsync, the response read, or NULL. It is released 
+ once the callback returns, so retain it to keep it.
+ @param context - The context pointer given with the request
+ */
+typedef void (*iUSBRecoveryDeviceCompletionCallback)(iUSBRecoveryDeviceRef device, Boolean success, UInt32 lengthDone, CFStringRef response, void *context);
+
 /*!
  @struct iUSBRecoveryDeviceNotificationContext
  @field disconnectCallback - The callback that will be called when the device disconnects. Must be non-NULL
@@ -62,6 +76,22 @@ typedef struct {
 	CFStringRef runLoopMode;
 } iUSBRecoveryDeviceNotificationContext;
 
+/*!
+ @struct iUSBRecoveryDeviceDescriptor
+ @field registryID - The IORegistry entry ID of the device. Used to open it later.
+ @field locationID - The USB location ID of the device, which encodes the bus and hub ports it is on
+ @field pid - The idProduct of the device. See @enum iUSBPID
+ @field ecid - The ECID of the device, or 0 if its serial number doesn't carry one
+ @field serialNumber - The USB serial number string of the device. May be NULL.
+ */
+typedef struct {
+	uint64_t registryID;
+	UInt32 locationID;
+	uint16_t pid;
+	uint64_t ecid;
+	CFStringRef serialNumber;
+} iUSBRecoveryDeviceDescriptor;
+
 /*!
  @function iUSBRecoveryDeviceCreateWithPID
  Enumerates all connected devices, searching for one that has a matching idProduct value.
@@ -73,13 +103,82 @@ typedef struct {
  */
 iUSBRecoveryDeviceRef iUSBRecoveryDeviceCreate(uint16_t pid, iUSBRecoveryDeviceNotificationContext *context);
 
+/*!
+ @function iUSBRecoveryDeviceCreateReplay
+ Create a device that exists only in the trace being replayed (see iUSBTraceReplayStart), so a recorded 
+ run can be reproduced without the hardware. Nothing is looked up or opened through IOKit; every 
+ transfer, blocking or async, is answered from the trace's records for deviceID. Once the replay stops, 
+ its transfers fail.
+ @param deviceID - The deviceID field of the records to replay, i.e. the recorded device's IORegistry entry ID.
+ @param pid - The mode the recorded device was in. See @enum iUSBPID.
+ @result A new device object which the caller is responsible for releasing, or NULL if no replay is running.
+ */
+iUSBRecoveryDeviceRef iUSBRecoveryDeviceCreateReplay(uint64_t deviceID, uint16_t pid);
+
+/*!
+ @function iUSBRecoveryDeviceEnumerate
+ Scans the bus once for every device in recovery or dfu mode, without opening any of them.
+ @param descriptors - On return, an array of descriptors for the devices found. Release it with 
+ iUSBRecoveryDeviceDescriptorsRelease.
+ @result The number of devices found, or -1 if the bus could not be scanned.
+ */
+CFIndex iUSBRecoveryDeviceEnumerate(iUSBRecoveryDeviceDescriptor **descriptors);
+
+/*!
+ @function iUSBRecoveryDeviceDescriptorsRelease
+ Deallocates an array of descriptors returned by iUSBRecoveryDeviceEnumerate.
+ @param descriptors - The array to deallocate.
+ @param count - The number of descriptors in the array.
+ */
+void iUSBRecoveryDeviceDescriptorsRelease(iUSBRecoveryDeviceDescriptor *descriptors, CFIndex count);
+
+/*!
+ @function iUSBRecoveryDeviceCreateWithDescriptor
+ Opens the device a descriptor from iUSBRecoveryDeviceEnumerate refers to.
+ @param descriptor - The descriptor of the device to open.
+ @param context - The optional notification context for disconnect notifications.
+ @result An iUSBRecoveryDeviceRef object, or NULL if the device has gone away or could not be opened.
+ */
+iUSBRecoveryDeviceRef iUSBRecoveryDeviceCreateWithDescriptor(const iUSBRecoveryDeviceDescriptor *descriptor, iUSBRecoveryDeviceNotificationContext *context);
+
+/*!
+ @function iUSBRecoveryDeviceRetain
+ Take an extra reference on the device object, e.g. before handing it to another thread.
+ Device objects may be used from several threads at once; control and bulk transfers are serialized 
+ separately, so a response can be read while an upload is running.
+ @param device - The device to retain.
+ @result The device given.
+ */
+iUSBRecoveryDeviceRef iUSBRecoveryDeviceRetain(iUSBRecoveryDeviceRef device);
+
 /*!
  @function iUSBRecoveryDeviceRelease
- Safely disconnects and deallocates the device object
- @param device - The device to deallocate.
+ Drops a reference on the device object. When the last reference goes, it safely disconnects and 
+ deallocates the device, waiting for any transfer in flight to finish first.
+ @param device - The device to release.
  */
 void iUSBRecoveryDeviceRelease(iUSBRecoveryDeviceRef device);
 
+/*!
+ @function iUSBRecoveryDeviceGetEventDescriptor
+ Deliver disconnect notifications through a file descriptor instead of a run loop. The descriptor 
+ (a kqueue) becomes readable when a notification is pending; then call iUSBRecoveryDeviceProcessEvents.
+ Only devices made with iUSBRecoveryDeviceCreate have their own disconnect notifications; 
+ listener devices are covered by iUSBListenerGetEventDescriptor.
+ @param device - The device to watch.
+ @param disconnectCallback - The callback that will be called when the device disconnects. Must be non-NULL
+ @result The descriptor, owned by the device, or -1 on failure.
+ */
+int iUSBRecoveryDeviceGetEventDescriptor(iUSBRecoveryDeviceRef device, iUSBRecoveryDeviceConnectionChangeCallback disconnectCallback);
+
+/*!
+ @function iUSBRecoveryDeviceProcessEvents
+ Deliver all pending notifications for the device without blocking.
+ @param device - The device whose event descriptor became readable.
+ @result The number of notifications delivered.
+ */
+int iUSBRecoveryDeviceProcessEvents(iUSBRecoveryDeviceRef device);
+
 /*!
  @function iUSBRecoveryDeviceGetPID
  Returns the PID of the device given.
@@ -88,6 +187,35 @@ void iUSBRecoveryDeviceRelease(iUSBRecoveryDeviceRef device);
  */
 uint16_t iUSBRecoveryDeviceGetPID(iUSBRecoveryDeviceRef device);
 
+/*!
+ @function iUSBRecoveryDeviceGetECID
+ Returns the ECID of the device given, parsed from its USB serial number string.
+ The ECID stays the same across mode changes, so it can be used to follow one device through reboots.
+ @param device - The device to return the ECID of.
+ @result The ECID of the given device, or 0 if it could not be read.
+ */
+uint64_t iUSBRecoveryDeviceGetECID(iUSBRecoveryDeviceRef device);
+
+/*!
+ @function iUSBRecoveryDeviceGetLocationID
+ Returns the USB location ID of the device given. The top byte is the bus the device is on, and each 
+ following nibble is a hub port on the way to it.
+ @param device - The device to return the location ID of.
+ @result The location ID of the given device, or 0 if it is unknown.
+ */
+UInt32 iUSBRecoveryDeviceGetLocationID(iUSBRecoveryDeviceRef device);
+
+/*!
+ @function iUSBRecoveryDeviceIsConnected
+ Check if the given device is currently attached and open.
+ A listener closes its devices as they detach, so a handle retained past the disconnect callback 
+ reports 0 from then on. A handle owned by a reattaching listener stays valid while the device is away, 
+ and is connected again once it comes back. This may be called from any thread.
+ @param device - The device to query.
+ @result A boolean value, stating whether the device is connected.
+ */
+Boolean iUSBRecoveryDeviceIsConnected(iUSBRecoveryDeviceRef device);
+
 /*!
  @function iUSBRecoveryDeviceSendCommand
  Sends a command to iBoot/iBEC/iBSS on the device in recovery mode.
@@ -109,6 +237,48 @@ Boolean iUSBRecoveryDeviceSendCommand(iUSBRecoveryDeviceRef device, CFStringRef
  */
 Boolean iUSBRecoveryDeviceSendFile(iUSBRecoveryDeviceRef device, CFStringRef filePath, iUSBRecoveryDeviceTransferProgressCallback progressCallback);
 
+/*!
+ @function iUSBRecoveryDeviceSendFileDescriptor
+ Sends the contents of an open file to a recovery/dfu mode device, from its start. Packets are read 
+ from the file as they are sent, so the upload fails cleanly if the file is truncated while it runs.
+ @param device - The device to send the file to. May be in recovery or dfu mode.
+ @param file - A descriptor for the file, open for reading. It is not closed.
+ @param progressCallback - Optional. A callback function that progress will be sent to.
+ @result A boolean value, stating whether the file was sent.
+ */
+Boolean iUSBRecoveryDeviceSendFileDescriptor(iUSBRecoveryDeviceRef device, int file, iUSBRecoveryDeviceTransferProgressCallback progressCallback);
+
+/*!
+ @function iUSBRecoveryDeviceSendData
+ Sends an in-memory image to a recovery/dfu mode device.
+ @param device - The device to send the data to. May be in recovery or dfu mode.
+ @param data - The data to send.
+ @param progressCallback - Optional. A callback function that progress will be sent to.
+ @result A boolean value, stating whether the data was sent.
+ */
+Boolean iUSBRecoveryDeviceSendData(iUSBRecoveryDeviceRef device, CFDataRef data, iUSBRecoveryDeviceTransferProgressCallback progressCallback);
+
+/*!
+ @function iUSBRecoveryDeviceGetLastTransferCRC32
+ Returns the CRC-32 of the last file sent to the device, computed while it was being sent.
+ @param device - The device the file was sent to.
+ @result The CRC-32 of the file's contents, or 0 if the last transfer did not complete.
+ */
+UInt32 iUSBRecoveryDeviceGetLastTransferCRC32(iUSBRecoveryDeviceRef device);
+
+/*!
+ @function iUSBRecoveryDeviceVerifyLastTransfer
+ Checks that the device received exactly what was sent by the last iUSBRecoveryDeviceSendFile call.
+ In recovery mode the device's filesize variable is read back and compared with the length sent.
+ A device in dfu mode has no way to be asked: the image carries a DFU suffix whose crc the device 
+ checks itself, but the result only shows once it manifests, so there 1 just means the upload got 
+ through all of its status polls.
+ @param device - The device the file was sent to.
+ @result A boolean value, stating whether the device confirmed the transfer, or in dfu mode, whether 
+ the upload completed.
+ */
+Boolean iUSBRecoveryDeviceVerifyLastTransfer(iUSBRecoveryDeviceRef device);
+
 /*!
  @function iUSBRecoveryDeviceReadResponse
  Read a response message from iBoot/iBEC/iBSS from a device in recovery mode.
@@ -130,6 +300,73 @@ CFStringRef iUSBRecoveryDeviceReadResponse(iUSBRecoveryDeviceRef device, UInt32
  */
 Boolean iUSBRecoveryDeviceSendControlMessage(iUSBRecoveryDeviceRef device, UInt8 bmRequestType, UInt8 bRequest, UInt16 wValue, UInt16 wIndex, UInt16 wLength, void *pData, UInt32 wLenDone);
 
+/*!
+ @function iUSBRecoveryDeviceScheduleWithRunLoop
+ Set up a device for the Async calls below, whose completions are delivered on the given run loop. 
+ One thread running a run loop can then keep transfers going on many devices at once. Requests on the 
+ control pipe run one after another in the order they were made, as do response reads, so a command 
+ and the read of its response can both be queued straight away.
+ A blocking call on the same pipe waits for a running request, such as an upload, to finish, and queued 
+ requests wait for the blocking call. Made on the run loop's own thread, where that wait could never end, 
+ the blocking call fails instead.
+ When a reattaching listener sees the device go away, a request already running fails, but those still 
+ queued behind it are kept and start once the device is reattached. They fail if it never comes back.
+ @param device - The device to schedule. It stays scheduled across reattaches.
+ @param runLoop - The run loop to deliver completions on. If NULL, CFRunLoopGetCurrent() will be assumed.
+ @param runLoopMode - The mode of your run loop to add to. If NULL, kCFRunLoopDefaultMode will be assumed.
+ @result A boolean value, stating whether the device was scheduled. A device can only be scheduled once.
+ */
+Boolean iUSBRecoveryDeviceScheduleWithRunLoop(iUSBRecoveryDeviceRef device, CFRunLoopRef runLoop, CFStringRef runLoopMode);
+
+/*!
+ @function iUSBRecoveryDeviceSendCommandAsync
+ Queue a command to be sent to a device. See iUSBRecoveryDeviceSendCommand.
+ @param device - The device to send the command to. Must be scheduled with a run loop.
+ @param command - The command to send.
+ @param callback - Optional. Called on the device's run loop once the command has been sent or has failed.
+ @param context - Optional. Passed back to callback.
+ @result A boolean value, stating whether the command was queued. If it was, callback will be called exactly once, 
+ possibly before this function returns if the device has gone away.
+ */
+Boolean iUSBRecoveryDeviceSendCommandAsync(iUSBRecoveryDeviceRef device, CFStringRef command, iUSBRecoveryDeviceCompletionCallback callback, void *context);
+
+/*!
+ @function iUSBRecoveryDeviceSendFileAsync
+ Queue a file to be sent to a device. See iUSBRecoveryDeviceSendFile. Each packet and status poll of the 
+ upload is its own request, so uploads to other devices on the same run loop proceed in between.
+ @param device - The device to send the file to. Must be scheduled with a run loop.
+ @param filePath - The file to send.
+ @param progressCallback - Optional. A callback function that progress will be sent to.
+ @param callback - Optional. Called on the device's run loop once the upload has finished or failed.
+ @param context - Optional. Passed back to callback.
+ @result A boolean value, stating whether the upload was queued. See iUSBRecoveryDeviceSendCommandAsync.
+ */
+Boolean iUSBRecoveryDeviceSendFileAsync(iUSBRecoveryDeviceRef device, CFStringRef filePath, iUSBRecoveryDeviceTransferProgressCallback progressCallback, iUSBRecoveryDeviceCompletionCallback callback, void *context);
+
+/*!
+ @function iUSBRecoveryDeviceReadResponseAsync
+ Queue a read of a response message from a device in recovery mode. See iUSBRecoveryDeviceReadResponse.
+ @param device - The device to read from. Must be scheduled with a run loop, and in recovery mode.
+ @param noDataTimeout - Time in milliseconds to wait for the device to start responding.
+ @param completionTimeout - Time in milliseconds to wait for the response to finish.
+ @param callback - Called on the device's run loop with the response.
+ @param context - Optional. Passed back to callback.
+ @result A boolean value, stating whether the read was queued. See iUSBRecoveryDeviceSendCommandAsync.
+ */
+Boolean iUSBRecoveryDeviceReadResponseAsync(iUSBRecoveryDeviceRef device, UInt32 noDataTimeout, UInt32 completionTimeout, iUSBRecoveryDeviceCompletionCallback callback, void *context);
+
+/*!
+ @function iUSBRecoveryDeviceSendControlMessageAsync
+ Queue a message to be sent via the device control pipe. See iUSBRecoveryDeviceSendControlMessage.
+ @param device - The device to send the message to. Must be scheduled with a run loop.
+ @param pData - The data stage of the request. Must stay valid until callback is called.
+ @param callback - Optional. Called on the device's run loop once the message has been sent or has failed.
+ @param context - Optional. Passed back to callback.
+ @param the rest of the parameters are those of the usb request.
+ @result A boolean value, stating whether the message was queued. See iUSBRecoveryDeviceSendCommandAsync.
+ */
+Boolean iUSBRecoveryDeviceSendControlMessageAsync(iUSBRecoveryDeviceRef device, UInt8 bmRequestType, UInt8 bRequest, UInt16 wValue, UInt16 wIndex, UInt16 wLength, void *pData, iUSBRecoveryDeviceCompletionCallback callback, void *context);
+
 /*!
  @function iUSBRecoveryDeviceIsInRecoveryMode
  Check if the given device is in recovery mode.
@@ -145,6 +382,15 @@ Boolean iUSBRecoveryDeviceIsInRecoveryMode(iUSBRecoveryDeviceRef device);
  */
 void iUSBRecoveryDeviceReboot(iUSBRecoveryDeviceRef device);
 
+/*!
+ @function iUSBRecoveryDeviceReset
+ Reset the device's port and have it re-enumerate. A device in dfu mode only starts the image it 
+ was sent once it is reset.
+ @param device - The device to reset.
+ @result A boolean value, stating whether the reset was issued.
+ */
+Boolean iUSBRecoveryDeviceReset(iUSBRecoveryDeviceRef device);
+
 /*!
  @function iUSBRecoveryDeviceSetAutoBoot
  Change whether the device boots into the OS regularly each boot.
@@ -0,0 +1,124 @@
+/*
+ *  recovery.hpp
+ *  iusbcomm
+ *
+ *  Created by John Heaton on 5/16/10.
+ *  Copyright 2010 Gojohnnyboi. All rights reserved.
+ *
+ */
+
+#ifndef IUSBCOMM_RECOVERY_HPP
+#define IUSBCOMM_RECOVERY_HPP
+
+#include <atomic>
+#include <coroutine>
+#include <utility>
+
+extern "C" {
+#include "recovery.h"
+}
+
+namespace iusbcomm {
+
+/*!
+ @struct RecoveryResult
+ @field success - Whether the request completed successfully
+ @field lengthDone - The number of bytes moved by the request. For file uploads, the length of the file.
+ @field response - For ReadResponseAsync, the response read, or NULL. Unlike in the C callback, it is 
+ retained for you, so release it when done.
+ */
+struct RecoveryResult {
+	bool success;
+	UInt32 lengthDone;
+	CFStringRef response;
+};
+
+/*!
+ @class RecoveryAwaitable
+ Wraps one of the iUSBRecoveryDevice*Async calls so a C++20 coroutine can co_await it. The request is 
+ queued when the coroutine suspends, and the coroutine is resumed on the device's run loop once the 
+ request's callback fires, or straight away if the request couldn't be queued or finished before the 
+ queueing call returned. The device must be scheduled with a run loop, and the awaitable must be 
+ awaited exactly once.
+ */
+template <typename Start>
+class RecoveryAwaitable {
+public:
+	explicit RecoveryAwaitable(Start start) : start_(std::move(start)) {}
+	
+	RecoveryAwaitable(const RecoveryAwaitable &) = delete;
+	RecoveryAwaitable &operator=(const RecoveryAwaitable &) = delete;
+	
+	bool await_ready() const noexcept { return false; }
+	
+	bool await_suspend(std::coroutine_handle<> handle) {
+		handle_ = handle;
+		if(!start_(&RecoveryAwaitable::completed, this)) return false;
+		
+		// the callback may have run before the async call returned; whichever of us comes second resumes
+		return state_.exchange(kSuspended) != kCompleted;
+	}
+	
+	RecoveryResult await_resume() noexcept { return result_; }
+
+private:
+	enum { kStarting, kSuspended, kCompleted };
+	
+	static void completed(iUSBRecoveryDeviceRef device, Boolean success, UInt32 lengthDone, CFStringRef response, void *context) {
+		RecoveryAwaitable *self = static_cast<RecoveryAwaitable *>(context);
+		self->result_.success = success;
+		self->result_.lengthDone = lengthDone;
+		self->result_.response = (response != NULL ? (CFStringRef)CFRetain(response) : NULL);
+		
+		if(self->state_.exchange(kCompleted) == kSuspended) self->handle_.resume();
+	}
+	
+	Start start_;
+	std::coroutine_handle<> handle_;
+	std::atomic<int> state_{kStarting};
+	RecoveryResult result_{false, 0, NULL};
+};
+
+/*!
+ @function SendCommandAsync
+ co_await form of iUSBRecoveryDeviceSendCommandAsync.
+ */
+inline auto SendCommandAsync(iUSBRecoveryDeviceRef device, CFStringRef command) {
+	return RecoveryAwaitable([=](iUSBRecoveryDeviceCompletionCallback callback, void *context) {
+		return iUSBRecoveryDeviceSendCommandAsync(device, command, callback, context) != 0;
+	});
+}
+
+/*!
+ @function SendFileAsync
+ co_await form of iUSBRecoveryDeviceSendFileAsync.
+ */
+inline auto SendFileAsync(iUSBRecoveryDeviceRef device, CFStringRef filePath, iUSBRecoveryDeviceTransferProgressCallback progressCallback = NULL) {
+	return RecoveryAwaitable([=](iUSBRecoveryDeviceCompletionCallback callback, void *context) {
+		return iUSBRecoveryDeviceSendFileAsync(device, filePath, progressCallback, callback, context) != 0;
+	});
+}
+
+/*!
+ @function ReadResponseAsync
+ co_await form of iUSBRecoveryDeviceReadResponseAsync.
+ */
+inline auto ReadResponseAsync(iUSBRecoveryDeviceRef device, UInt32 noDataTimeout, UInt32 completionTimeout) {
+	return RecoveryAwaitable([=](iUSBRecoveryDeviceCompletionCallback callback, void *context) {
+		return iUSBRecoveryDeviceReadResponseAsync(device, noDataTimeout, completionTimeout, callback, context) != 0;
+	});
+}
+
+/*!
+ @function SendControlMessageAsync
+ co_await form of iUSBRecoveryDeviceSendControlMessageAsync. pData must stay valid until the await resumes.
+ */
+inline auto SendControlMessageAsync(iUSBRecoveryDeviceRef device, UInt8 bmRequestType, UInt8 bRequest, UInt16 wValue, UInt16 wIndex, UInt16 wLength, void *pData) {
+	return RecoveryAwaitable([=](iUSBRecoveryDeviceCompletionCallback callback, void *context) {
+		return iUSBRecoveryDeviceSendControlMessageAsync(device, bmRequestType, bRequest, wValue, wIndex, wLength, pData, callback, context) != 0;
+	});
+}
+
+}
+
+#endif
\ No newline at end of file
@@ -0,0 +1,319 @@
+/*
+ *  restore.c
+ *  iusbcomm
+ *
+ *  Created by John Heaton on 5/16/10.
+ *  Copyright 2010 Gojohnnyboi. All rights reserved.
+ *
+ */
+
+#include "restore.h"
+#include "helper.h"
+
+#include <fcntl.h>
+#include <limits.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+// how long a device that dropped off the bus mid-restore is waited for before its restore is failed
+#define kRestoreReconnectTimeout 120.0
+
+struct __iUSBRestoreDevice {
+	iUSBRestoreRef restore;
+	uint64_t ecid;
+	CFIndex stage;
+	CFAbsoluteTime stageStart;
+	int stagedFile;
+	Boolean running;
+	iUSBRecoveryDeviceRef device;
+	CFAbsoluteTime disconnectTime;
+	struct __iUSBRestoreDevice *next;
+};
+
+struct __iUSBRestore {
+	iUSBRestoreStage *stages;
+	CFIndex stageCount;
+	iUSBRestoreStageCallback stageCallback;
+	void *context;
+	iUSBUploadSchedulerRef scheduler;
+	pthread_mutex_t lock;
+	pthread_cond_t idle;
+	CFIndex workers;
+	Boolean stopping;
+	struct __iUSBRestoreDevice *devices;
+};
+
+HIDDEN void restoreStageImage(iUSBRestoreRef restore, struct __iUSBRestoreDevice *state);
+HIDDEN void restoreRemoveDevice(iUSBRestoreRef restore, struct __iUSBRestoreDevice *state);
+HIDDEN void restoreExpireDevices(iUSBRestoreRef restore);
+HIDDEN void *restoreWorker(void *state_);
+HIDDEN Boolean restoreRunStages(iUSBRestoreRef restore, struct __iUSBRestoreDevice *state, iUSBRecoveryDeviceRef device);
+
+iUSBRestoreRef iUSBRestoreCreate(const iUSBRestoreStage *stages, CFIndex stageCount, iUSBRestoreStageCallback stageCallback, void *context) {
+	if(stages == NULL || stageCount <= 0)
+		return NULL;
+	
+	iUSBRestoreRef newRestore = calloc(1, sizeof(struct __iUSBRestore));
+	newRestore->stages = calloc(stageCount, sizeof(iUSBRestoreStage));
+	newRestore->stageCount = stageCount;
+	newRestore->stageCallback = stageCallback;
+	newRestore->context = context;
+	pthread_mutex_init(&newRestore->lock, NULL);
+	pthread_cond_init(&newRestore->idle, NULL);
+	
+	CFIndex i;
+	for(i = 0; i < stageCount; ++i) {
+		newRestore->stages[i] = stages[i];
+		if(stages[i].filePath) CFRetain(stages[i].filePath);
+		if(stages[i].command) CFRetain(stages[i].command);
+	}
+	
+	return newRestore;
+}
+
+void iUSBRestoreSetUploadScheduler(iUSBRestoreRef restore, iUSBUploadSchedulerRef scheduler) {
+	if(restore == NULL)
+		return;
+	
+	pthread_mutex_lock(&restore->lock);
+	restore->scheduler = scheduler;
+	pthread_mutex_unlock(&restore->lock);
+}
+
+void iUSBRestoreHandleConnectionChange(iUSBRestoreRef restore, iUSBRecoveryDeviceRef device, uint8_t newConnectionState) {
+	if(restore == NULL || device == NULL)
+		return;
+	
+	restoreExpireDevices(restore);
+	
+	uint64_t ecid = iUSBRecoveryDeviceGetECID(device);
+	if(ecid == 0)
+		return;
+	
+	pthread_mutex_lock(&restore->lock);
+	
+	struct __iUSBRestoreDevice *state = restore->devices;
+	while(state != NULL && state->ecid != ecid) state = state->next;
+	
+	if(newConnectionState != kUSBConnected) {
+		// a device that never started has nothing to come back for; one part way through gets some time to reappear
+		if(state != NULL) {
+			if(state->device != NULL) iUSBRecoveryDeviceRelease(state->device);
+			state->device = NULL;
+			
+			if(state->stage == 0 && !state->running)
+				restoreRemoveDevice(restore, state);
+			else
+				state->disconnectTime = CFAbsoluteTimeGetCurrent();
+		}
+		
+		pthread_mutex_unlock(&restore->lock);
+		return;
+	}
+	
+	if(state == NULL) {
+		state = calloc(1, sizeof(struct __iUSBRestoreDevice));
+		state->restore = restore;
+		state->ecid = ecid;
+		state->stagedFile = -1;
+		state->stageStart = CFAbsoluteTimeGetCurrent();
+		state->next = restore->devices;
+		restore->devices = state;
+	}
+	
+	state->disconnectTime = 0;
+	
+	// a worker that is still finishing up with the old connection picks the new one up when it's done
+	if(state->device != NULL) iUSBRecoveryDeviceRelease(state->device);
+	state->device = iUSBRecoveryDeviceRetain(device);
+	
+	if(state->running) {
+		pthread_mutex_unlock(&restore->lock);
+		return;
+	}
+	
+	state->running = 1;
+	restore->workers++;
+	
+	pthread_t thread;
+	pthread_attr_t attributes;
+	pthread_attr_init(&attributes);
+	pthread_attr_setdetachstate(&attributes, PTHREAD_CREATE_DETACHED);
+	if(pthread_create(&thread, &attributes, restoreWorker, state) != 0) {
+		iUSBRecoveryDeviceRelease(state->device);
+		state->device = NULL;
+		state->running = 0;
+		restore->workers--;
+	}
+	pthread_attr_destroy(&attributes);
+	
+	pthread_mutex_unlock(&restore->lock);
+}
+
+void iUSBRestoreRelease(iUSBRestoreRef restore) {
+	if(restore != NULL) {
+		// workers finish the stage they are on, but don't pick up another connection
+		pthread_mutex_lock(&restore->lock);
+		restore->stopping = 1;
+		while(restore->workers > 0) pthread_cond_wait(&restore->idle, &restore->lock);
+		while(restore->devices != NULL) restoreRemoveDevice(restore, restore->devices);
+		pthread_mutex_unlock(&restore->lock);
+		
+		CFIndex i;
+		for(i = 0; i < restore->stageCount; ++i) {
+			if(restore->stages[i].filePath) CFRelease(restore->stages[i].filePath);
+			if(restore->stages[i].command) CFRelease(restore->stages[i].command);
+		}
+		
+		pthread_cond_destroy(&restore->idle);
+		pthread_mutex_destroy(&restore->lock);
+		free(restore->stages);
+		free(restore);
+	}
+}
+
+HIDDEN void *restoreWorker(void *state_) {
+	struct __iUSBRestoreDevice *state = state_;
+	iUSBRestoreRef restore = state->restore;
+	
+	pthread_mutex_lock(&restore->lock);
+	Boolean waiting = 1;
+	while(waiting && state->device != NULL && !restore->stopping) {
+		iUSBRecoveryDeviceRef device = state->device;
+		state->device = NULL;
+		pthread_mutex_unlock(&restore->lock);
+		
+		// stages block for as long as the uploads take, so they run here rather than on the listener's thread
+		waiting = restoreRunStages(restore, state, device);
+		iUSBRecoveryDeviceRelease(device);
+		
+		pthread_mutex_lock(&restore->lock);
+	}
+	
+	// the same rule as a disconnect in iUSBRestoreHandleConnectionChange, for one that came in while this ran
+	state->running = 0;
+	if(!waiting || (state->stage == 0 && state->disconnectTime != 0))
+		restoreRemoveDevice(restore, state);
+	
+	restore->workers--;
+	pthread_cond_broadcast(&restore->idle);
+	pthread_mutex_unlock(&restore->lock);
+	
+	return NULL;
+}
+
+// runs the stages that match the device's current mode. returns 0 once the device is done, either way
+HIDDEN Boolean restoreRunStages(iUSBRestoreRef restore, struct __iUSBRestoreDevice *state, iUSBRecoveryDeviceRef device) {
+	while(state->stage < restore->stageCount) {
+		iUSBRestoreStage *stage = &restore->stages[state->stage];
+		if(stage->pid != 0 && stage->pid != iUSBRecoveryDeviceGetPID(device))
+			return 1;
+		
+		if(stage->filePath) restoreStageImage(restore, state);
+		
+		pthread_mutex_lock(&restore->lock);
+		iUSBUploadSchedulerRef scheduler = restore->scheduler;
+		pthread_mutex_unlock(&restore->lock);
+		
+		Boolean success = 1;
+		if(stage->filePath && scheduler != NULL) {
+			int priority = -(int)(restore->stageCount - state->stage);
+			success = (state->stagedFile >= 0 && iUSBUploadSchedulerSendFileDescriptor(scheduler, device, state->stagedFile, priority, NULL));
+		} else if(stage->filePath) {
+			success = (state->stagedFile >= 0 && iUSBRecoveryDeviceSendFileDescriptor(device, state->stagedFile, NULL));
+		}
+		
+		if(state->stagedFile >= 0) close(state->stagedFile);
+		state->stagedFile = -1;
+		
+		// a dfu device only starts the image once it's reset
+		if(success && stage->expectsReconnect && !iUSBRecoveryDeviceIsInRecoveryMode(device))
+			iUSBRecoveryDeviceReset(device);
+		
+		// a command that reboots the device reports failure, so only trust it when we expect to stay connected
+		if(success && stage->command) {
+			Boolean sent = iUSBRecoveryDeviceSendCommand(device, stage->command);
+			if(!stage->expectsReconnect) success = sent;
+		}
+		
+		CFAbsoluteTime now = CFAbsoluteTimeGetCurrent();
+		if(restore->stageCallback != NULL) 
+			restore->stageCallback(restore->context, state->ecid, state->stage, success, now - state->stageStart);
+		
+		if(!success)
+			return 0;
+		
+		state->stage++;
+		state->stageStart = now;
+		
+		if(stage->expectsReconnect) {
+			if(state->stage < restore->stageCount) restoreStageImage(restore, state);
+			return (state->stage < restore->stageCount ? 1 : 0);
+		}
+	}
+	
+	return 0;
+}
+
+// fails the restore of devices that dropped off the bus and didn't come back in time
+HIDDEN void restoreExpireDevices(iUSBRestoreRef restore) {
+	CFAbsoluteTime now = CFAbsoluteTimeGetCurrent();
+	
+	pthread_mutex_lock(&restore->lock);
+	struct __iUSBRestoreDevice **link = &restore->devices;
+	struct __iUSBRestoreDevice *expired = NULL;
+	while(*link != NULL) {
+		struct __iUSBRestoreDevice *state = *link;
+		if(!state->running && state->disconnectTime != 0 && now - state->disconnectTime > kRestoreReconnectTimeout) {
+			*link = state->next;
+			state->next = expired;
+			expired = state;
+		} else {
+			link = &state->next;
+		}
+	}
+	pthread_mutex_unlock(&restore->lock);
+	
+	while(expired != NULL) {
+		struct __iUSBRestoreDevice *state = expired;
+		expired = state->next;
+		
+		if(restore->stageCallback != NULL)
+			restore->stageCallback(restore->context, state->ecid, state->stage, 0, now - state->stageStart);
+		
+		if(state->stagedFile >= 0) close(state->stagedFile);
+		free(state);
+	}
+}
+
+// opens the image for the device's current stage and has the file system start reading it in while the device reboots
+HIDDEN void restoreStageImage(iUSBRestoreRef restore, struct __iUSBRestoreDevice *state) {
+	CFStringRef filePath = restore->stages[state->stage].filePath;
+	if(state->stagedFile >= 0 || filePath == NULL) return;
+	
+	char path[PATH_MAX];
+	if(!CFStringGetFileSystemRepresentation(filePath, path, sizeof(path)))
+		return;
+	
+	state->stagedFile = open(path, O_RDONLY);
+	
+	struct stat check;
+	if(state->stagedFile >= 0 && fstat(state->stagedFile, &check) == 0) {
+		struct radvisory advice;
+		advice.ra_offset = 0;
+		advice.ra_count = (int)(check.st_size < INT_MAX ? check.st_size : INT_MAX);
+		fcntl(state->stagedFile, F_RDADVISE, &advice);
+	}
+}
+
+// called with the restore lock held
+HIDDEN void restoreRemoveDevice(iUSBRestoreRef restore, struct __iUSBRestoreDevice *state) {
+	struct __iUSBRestoreDevice **link = &restore->devices;
+	while(*link != NULL && *link != state) link = &(*link)->next;
+	if(*link != NULL) *link = state->next;
+	
+	if(state->device) iUSBRecoveryDeviceRelease(state->device);
+	if(state->stagedFile >= 0) close(state->stagedFile);
+	free(state);
+}
\ No newline at end of file
@@ -0,0 +1,87 @@
+/*
+ *  restore.h
+ *  iusbcomm
+ *
+ *  Created by John Heaton on 5/16/10.
+ *  Copyright 2010 Gojohnnyboi. All rights reserved.
+ *
+ */
+
+#ifndef IUSBCOMM_RESTORE_H
+#define IUSBCOMM_RESTORE_H
+
+#include "recovery.h"
+#include "scheduler.h"
+
+typedef struct __iUSBRestore *iUSBRestoreRef;
+
+/*!
+ @struct iUSBRestoreStage
+ @field pid - The idProduct the device must have for this stage to run. 0 matches any mode.
+ @field filePath - Optional. The image to send to the device.
+ @field command - Optional. The command to send once the image has been sent. Must be NULL in dfu mode.
+ @field expectsReconnect - Whether the device re-enumerates after this stage. The next stage will run 
+ once the same device (matched by ECID) connects again.
+ */
+typedef struct {
+	uint16_t pid;
+	CFStringRef filePath;
+	CFStringRef command;
+	Boolean expectsReconnect;
+} iUSBRestoreStage;
+
+/*!
+ @typedef iUSBRestoreStageCallback
+ @param context - The context pointer given to iUSBRestoreCreate
+ @param ecid - The ECID of the device the stage ran on
+ @param stageIndex - The index of the stage in the stage list
+ @param success - Whether the stage completed. A failed stage ends the restore for that device. A device 
+ that doesn't reconnect within two minutes of dropping off the bus mid-restore fails its next stage.
+ @param duration - Seconds from the end of the previous stage (or first connection) to the end of this one. 
+ This includes the time the device spent re-enumerating.
+ The callback is called on the thread that runs the device's stages, or for a device that didn't 
+ reconnect, from iUSBRestoreHandleConnectionChange. It must not release the restore.
+ */
+typedef void (*iUSBRestoreStageCallback)(void *context, uint64_t ecid, CFIndex stageIndex, Boolean success, CFTimeInterval duration);
+
+/*!
+ @function iUSBRestoreCreate
+ Create a restore flow that walks each connected device through the given list of stages.
+ @param stages - The stages to run, in order. The list is copied.
+ @param stageCount - The number of stages.
+ @param stageCallback - Optional. A callback that is told when each stage finishes.
+ @param context - Optional. Passed back to stageCallback.
+ @result A new restore object which the caller is responsible for releasing
+ */
+iUSBRestoreRef iUSBRestoreCreate(const iUSBRestoreStage *stages, CFIndex stageCount, iUSBRestoreStageCallback stageCallback, void *context);
+
+/*!
+ @function iUSBRestoreSetUploadScheduler
+ Have stage images go through a scheduler, so devices on a busy bus take turns. Devices with fewer 
+ stages left are admitted first.
+ @param restore - The restore flow.
+ @param scheduler - The scheduler, or NULL to send images straight away. It must outlive the restore.
+ */
+void iUSBRestoreSetUploadScheduler(iUSBRestoreRef restore, iUSBUploadSchedulerRef scheduler);
+
+/*!
+ @function iUSBRestoreHandleConnectionChange
+ Feed a connection change from your listener callback into the restore flow.
+ Stages run on a thread of their own for each device as soon as it arrives in the right mode, so 
+ this returns straight away. The image for the following stage is opened and read ahead while the 
+ device reboots, and a device in dfu mode is reset after its image is sent when the stage expects 
+ it to reconnect. Devices that disconnect before their first stage are forgotten.
+ @param restore - The restore flow.
+ @param device - The device given to your listener callback.
+ @param newConnectionState - The state given to your listener callback.
+ */
+void iUSBRestoreHandleConnectionChange(iUSBRestoreRef restore, iUSBRecoveryDeviceRef device, uint8_t newConnectionState);
+
+/*!
+ @function iUSBRestoreRelease
+ Safely clean up and deallocate a restore object. Waits for a stage that is still running to finish.
+ @param restore - The restore flow to deallocate
+ */
+void iUSBRestoreRelease(iUSBRestoreRef restore);
+
+#endif /* IUSBCOMM_RESTORE_H */
@@ -0,0 +1,362 @@
+/*
+ *  scheduler.c
+ *  iusbcomm
+ *
+ *  Created by John Heaton on 5/16/10.
+ *  Copyright 2010 Gojohnnyboi. All rights reserved.
+ *
+ */
+
+#include "scheduler.h"
+#include "helper.h"
+
+#include <fcntl.h>
+#include <limits.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+// a probe for one more upload per bus has to raise throughput by this much to be kept
+#define kSchedulerProbeGain 1.05
+// windows to stay at a limit after a probe that didn't pay off, before probing again
+#define kSchedulerHoldWindows 4
+
+struct __iUSBUploadAsync;
+
+struct __iUSBUploadWaiter {
+	UInt8 bus;
+	int priority;
+	CFIndex length;
+	Boolean admitted;
+	struct __iUSBUploadAsync *async;
+	struct __iUSBUploadWaiter *next;
+};
+
+struct __iUSBUploadAsync {
+	struct __iUSBUploadWaiter waiter;
+	iUSBUploadSchedulerRef scheduler;
+	iUSBRecoveryDeviceRef device;
+	CFStringRef filePath;
+	iUSBRecoveryDeviceTransferProgressCallback progressCallback;
+	iUSBRecoveryDeviceCompletionCallback callback;
+	void *context;
+	struct __iUSBUploadAsync *nextStart;
+};
+
+struct __iUSBBusState {
+	CFIndex active;
+	CFIndex limit;
+	Float64 throughput;
+	Float64 baseThroughput;
+	Boolean probing;
+	int hold;
+	CFAbsoluteTime busySince;
+	CFTimeInterval windowBusy;
+	Float64 windowBytes;
+	CFIndex windowUploads;
+	Boolean windowSaturated;
+};
+
+struct __iUSBUploadScheduler {
+	pthread_mutex_t lock;
+	pthread_cond_t slotFreed;
+	CFIndex maxUploadsPerBus;
+	struct __iUSBBusState buses[256];
+	struct __iUSBUploadWaiter *waiters;
+};
+
+HIDDEN void schedulerInitWaiter(struct __iUSBUploadWaiter *waiter, iUSBRecoveryDeviceRef device, CFIndex length, int priority);
+HIDDEN void schedulerEnqueue(iUSBUploadSchedulerRef scheduler, struct __iUSBUploadWaiter *waiter);
+HIDDEN struct __iUSBUploadAsync *schedulerAdmit(iUSBUploadSchedulerRef scheduler);
+HIDDEN void schedulerWait(iUSBUploadSchedulerRef scheduler, struct __iUSBUploadWaiter *waiter);
+HIDDEN void schedulerFinish(iUSBUploadSchedulerRef scheduler, UInt8 busNumber, CFIndex length, Boolean success);
+HIDDEN void schedulerEvaluate(iUSBUploadSchedulerRef scheduler, UInt8 busNumber);
+HIDDEN void schedulerStartAsync(struct __iUSBUploadAsync *starts);
+HIDDEN void schedulerAsyncCompleted(iUSBRecoveryDeviceRef device, Boolean success, UInt32 lengthDone, CFStringRef response, void *context);
+
+iUSBUploadSchedulerRef iUSBUploadSchedulerCreate(CFIndex maxUploadsPerBus) {
+	iUSBUploadSchedulerRef newScheduler = calloc(1, sizeof(struct __iUSBUploadScheduler));
+	newScheduler->maxUploadsPerBus = (maxUploadsPerBus > 0 ? maxUploadsPerBus : 1);
+	
+	int i;
+	for(i = 0; i < 256; ++i) {
+		newScheduler->buses[i].limit = 1;
+		newScheduler->buses[i].windowSaturated = 1;
+	}
+	
+	pthread_mutex_init(&newScheduler->lock, NULL);
+	pthread_cond_init(&newScheduler->slotFreed, NULL);
+	
+	return newScheduler;
+}
+
+Boolean iUSBUploadSchedulerSendData(iUSBUploadSchedulerRef scheduler, iUSBRecoveryDeviceRef device, CFDataRef data, int priority, iUSBRecoveryDeviceTransferProgressCallback progressCallback) {
+	if(scheduler == NULL || device == NULL || data == NULL)
+		return 0;
+	
+	struct __iUSBUploadWaiter waiter;
+	schedulerInitWaiter(&waiter, device, CFDataGetLength(data), priority);
+	schedulerWait(scheduler, &waiter);
+	
+	Boolean retVal = iUSBRecoveryDeviceSendData(device, data, progressCallback);
+	schedulerFinish(scheduler, waiter.bus, waiter.length, retVal);
+	
+	return retVal;
+}
+
+Boolean iUSBUploadSchedulerSendFile(iUSBUploadSchedulerRef scheduler, iUSBRecoveryDeviceRef device, CFStringRef filePath, int priority, iUSBRecoveryDeviceTransferProgressCallback progressCallback) {
+	if(scheduler == NULL || device == NULL || filePath == NULL)
+		return 0;
+	
+	char path[PATH_MAX];
+	if(!CFStringGetFileSystemRepresentation(filePath, path, sizeof(path)))
+		return 0;
+	
+	int file = open(path, O_RDONLY);
+	if(file < 0)
+		return 0;
+	
+	Boolean retVal = iUSBUploadSchedulerSendFileDescriptor(scheduler, device, file, priority, progressCallback);
+	close(file);
+	
+	return retVal;
+}
+
+Boolean iUSBUploadSchedulerSendFileDescriptor(iUSBUploadSchedulerRef scheduler, iUSBRecoveryDeviceRef device, int file, int priority, iUSBRecoveryDeviceTransferProgressCallback progressCallback) {
+	struct stat check;
+	if(scheduler == NULL || device == NULL || file < 0 || fstat(file, &check) != 0)
+		return 0;
+	
+	struct __iUSBUploadWaiter waiter;
+	schedulerInitWaiter(&waiter, device, (CFIndex)check.st_size, priority);
+	schedulerWait(scheduler, &waiter);
+	
+	Boolean retVal = iUSBRecoveryDeviceSendFileDescriptor(device, file, progressCallback);
+	schedulerFinish(scheduler, waiter.bus, waiter.length, retVal);
+	
+	return retVal;
+}
+
+Boolean iUSBUploadSchedulerSendFileAsync(iUSBUploadSchedulerRef scheduler, iUSBRecoveryDeviceRef device, CFStringRef filePath, int priority, iUSBRecoveryDeviceTransferProgressCallback progressCallback, iUSBRecoveryDeviceCompletionCallback callback, void *context) {
+	if(scheduler == NULL || device == NULL || filePath == NULL)
+		return 0;
+	
+	char path[PATH_MAX];
+	struct stat check;
+	if(!CFStringGetFileSystemRepresentation(filePath, path, sizeof(path)) || stat(path, &check) != 0)
+		return 0;
+	
+	struct __iUSBUploadAsync *upload = calloc(1, sizeof(struct __iUSBUploadAsync));
+	if(upload == NULL)
+		return 0;
+	
+	schedulerInitWaiter(&upload->waiter, device, (CFIndex)check.st_size, priority);
+	upload->waiter.async = upload;
+	upload->scheduler = scheduler;
+	upload->device = iUSBRecoveryDeviceRetain(device);
+	upload->filePath = CFRetain(filePath);
+	upload->progressCallback = progressCallback;
+	upload->callback = callback;
+	upload->context = context;
+	
+	// waits in the same line as blocking uploads, and is started by whichever upload frees its slot
+	pthread_mutex_lock(&scheduler->lock);
+	schedulerEnqueue(scheduler, &upload->waiter);
+	struct __iUSBUploadAsync *starts = schedulerAdmit(scheduler);
+	pthread_mutex_unlock(&scheduler->lock);
+	
+	schedulerStartAsync(starts);
+	
+	return 1;
+}
+
+Float64 iUSBUploadSchedulerGetBusThroughput(iUSBUploadSchedulerRef scheduler, UInt8 bus) {
+	if(scheduler == NULL)
+		return 0;
+	
+	pthread_mutex_lock(&scheduler->lock);
+	Float64 throughput = scheduler->buses[bus].throughput;
+	pthread_mutex_unlock(&scheduler->lock);
+	
+	return throughput;
+}
+
+CFIndex iUSBUploadSchedulerGetBusLimit(iUSBUploadSchedulerRef scheduler, UInt8 bus) {
+	if(scheduler == NULL)
+		return 0;
+	
+	pthread_mutex_lock(&scheduler->lock);
+	CFIndex limit = scheduler->buses[bus].limit;
+	pthread_mutex_unlock(&scheduler->lock);
+	
+	return limit;
+}
+
+void iUSBUploadSchedulerRelease(iUSBUploadSchedulerRef scheduler) {
+	if(scheduler != NULL) {
+		pthread_mutex_destroy(&scheduler->lock);
+		pthread_cond_destroy(&scheduler->slotFreed);
+		
+		free(scheduler);
+	}
+}
+
+HIDDEN void schedulerInitWaiter(struct __iUSBUploadWaiter *waiter, iUSBRecoveryDeviceRef device, CFIndex length, int priority) {
+	waiter->bus = (UInt8)(iUSBRecoveryDeviceGetLocationID(device) >> 24);
+	waiter->priority = priority;
+	waiter->length = length;
+	waiter->admitted = 0;
+	waiter->async = NULL;
+	waiter->next = NULL;
+}
+
+HIDDEN void schedulerEnqueue(iUSBUploadSchedulerRef scheduler, struct __iUSBUploadWaiter *waiter) {
+	struct __iUSBUploadWaiter **link = &scheduler->waiters;
+	while(*link != NULL) {
+		struct __iUSBUploadWaiter *other = *link;
+		if(waiter->priority > other->priority) break;
+		if(waiter->priority == other->priority && waiter->length < other->length) break;
+		link = &other->next;
+	}
+	
+	waiter->next = *link;
+	*link = waiter;
+}
+
+// called with the scheduler lock held. admits waiters in line order while their buses have free slots, 
+// and returns the async ones, which the caller starts once the lock is dropped
+HIDDEN struct __iUSBUploadAsync *schedulerAdmit(iUSBUploadSchedulerRef scheduler) {
+	struct __iUSBUploadAsync *starts = NULL;
+	struct __iUSBUploadAsync **tail = &starts;
+	
+	// only the first waiter in line for a bus may take its free slots, so priorities hold per bus
+	Boolean held[256];
+	memset(held, 0, sizeof(held));
+	
+	struct __iUSBUploadWaiter **link = &scheduler->waiters;
+	while(*link != NULL) {
+		struct __iUSBUploadWaiter *waiter = *link;
+		struct __iUSBBusState *bus = &scheduler->buses[waiter->bus];
+		if(held[waiter->bus] || bus->active >= bus->limit) {
+			held[waiter->bus] = 1;
+			link = &waiter->next;
+			continue;
+		}
+		
+		*link = waiter->next;
+		waiter->admitted = 1;
+		
+		if(bus->active++ == 0) bus->busySince = CFAbsoluteTimeGetCurrent();
+		
+		if(waiter->async != NULL) {
+			*tail = waiter->async;
+			tail = &waiter->async->nextStart;
+		}
+	}
+	
+	return starts;
+}
+
+HIDDEN void schedulerWait(iUSBUploadSchedulerRef scheduler, struct __iUSBUploadWaiter *waiter) {
+	pthread_mutex_lock(&scheduler->lock);
+	schedulerEnqueue(scheduler, waiter);
+	struct __iUSBUploadAsync *starts = schedulerAdmit(scheduler);
+	while(!waiter->admitted) {
+		pthread_cond_wait(&scheduler->slotFreed, &scheduler->lock);
+	}
+	pthread_mutex_unlock(&scheduler->lock);
+	
+	schedulerStartAsync(starts);
+}
+
+HIDDEN void schedulerFinish(iUSBUploadSchedulerRef scheduler, UInt8 busNumber, CFIndex length, Boolean success) {
+	struct __iUSBBusState *bus = &scheduler->buses[busNumber];
+	
+	pthread_mutex_lock(&scheduler->lock);
+	if(--bus->active == 0) bus->windowBusy += CFAbsoluteTimeGetCurrent() - bus->busySince;
+	
+	if(success) {
+		bus->windowBytes += length;
+		bus->windowUploads++;
+	}
+	
+	// nobody left waiting means the limit wasn't what held the bus back, so the window says nothing about it
+	struct __iUSBUploadWaiter *waiter = scheduler->waiters;
+	while(waiter != NULL && waiter->bus != busNumber) waiter = waiter->next;
+	if(waiter == NULL) bus->windowSaturated = 0;
+	
+	schedulerEvaluate(scheduler, busNumber);
+	
+	struct __iUSBUploadAsync *starts = schedulerAdmit(scheduler);
+	pthread_cond_broadcast(&scheduler->slotFreed);
+	pthread_mutex_unlock(&scheduler->lock);
+	
+	schedulerStartAsync(starts);
+}
+
+// called with the scheduler lock held
+HIDDEN void schedulerEvaluate(iUSBUploadSchedulerRef scheduler, UInt8 busNumber) {
+	struct __iUSBBusState *bus = &scheduler->buses[busNumber];
+	
+	// a window lasts long enough for every slot to turn over twice, so one slow upload can't swing it
+	if(bus->windowUploads < bus->limit * 2)
+		return;
+	
+	CFAbsoluteTime now = CFAbsoluteTimeGetCurrent();
+	CFTimeInterval busy = bus->windowBusy;
+	if(bus->active > 0) {
+		busy += now - bus->busySince;
+		bus->busySince = now;
+	}
+	
+	// bytes count toward the window an upload finishes in, against the wall time the bus had anything running
+	if(bus->windowSaturated && busy > 0) {
+		bus->throughput = bus->windowBytes / busy;
+		
+		if(bus->probing) {
+			bus->probing = 0;
+			if(bus->throughput > bus->baseThroughput * kSchedulerProbeGain) {
+				bus->baseThroughput = bus->throughput;
+			} else {
+				bus->limit--;
+				bus->hold = kSchedulerHoldWindows;
+			}
+		} else {
+			bus->baseThroughput = bus->throughput;
+			if(bus->hold > 0) bus->hold--;
+		}
+		
+		if(!bus->probing && bus->hold == 0 && bus->limit < scheduler->maxUploadsPerBus) {
+			bus->probing = 1;
+			bus->limit++;
+		}
+	}
+	
+	bus->windowBusy = 0;
+	bus->windowBytes = 0;
+	bus->windowUploads = 0;
+	bus->windowSaturated = 1;
+}
+
+HIDDEN void schedulerStartAsync(struct __iUSBUploadAsync *starts) {
+	while(starts != NULL) {
+		struct __iUSBUploadAsync *upload = starts;
+		starts = upload->nextStart;
+		
+		// a request that can't be queued never calls back, so its slot is given up here instead
+		if(!iUSBRecoveryDeviceSendFileAsync(upload->device, upload->filePath, upload->progressCallback, schedulerAsyncCompleted, upload)) {
+			schedulerAsyncCompleted(upload->device, 0, 0, NULL, upload);
+		}
+	}
+}
+
+HIDDEN void schedulerAsyncCompleted(iUSBRecoveryDeviceRef device, Boolean success, UInt32 lengthDone, CFStringRef response, void *context) {
+	struct __iUSBUploadAsync *upload = context;
+	
+	schedulerFinish(upload->scheduler, upload->waiter.bus, upload->waiter.length, success);
+	if(upload->callback != NULL) upload->callback(device, success, lengthDone, response, upload->context);
+	
+	iUSBRecoveryDeviceRelease(upload->device);
+	CFRelease(upload->filePath);
+	free(upload);
+}
\ No newline at end of file
@@ -0,0 +1,114 @@
+/*
+ *  scheduler.h
+ *  iusbcomm
+ *
+ *  Created by John Heaton on 5/16/10.
+ *  Copyright 2010 Gojohnnyboi. All rights reserved.
+ *
+ */
+
+#ifndef IUSBCOMM_SCHEDULER_H
+#define IUSBCOMM_SCHEDULER_H
+
+#include "recovery.h"
+
+typedef struct __iUSBUploadScheduler *iUSBUploadSchedulerRef;
+
+/*!
+ @function iUSBUploadSchedulerCreate
+ Create a scheduler that admits concurrent uploads per USB bus, so uploads to many devices don't 
+ saturate one host controller. The number of uploads allowed on each bus starts at one. Each bus's 
+ throughput is measured as the bytes its uploads moved over the wall time it was busy, across a window 
+ of uploads run while others were waiting. After each window the limit is raised by one as a probe; a 
+ probe that doesn't raise throughput by 5% is undone, and the bus stays at that limit for four windows 
+ before probing again. The limit never goes past maxUploadsPerBus.
+ Blocking and async uploads wait in one line, so every kind of upload below is admitted the same way.
+ @param maxUploadsPerBus - The most uploads that will ever run at once on one bus.
+ @result A new scheduler object which the caller is responsible for releasing
+ */
+iUSBUploadSchedulerRef iUSBUploadSchedulerCreate(CFIndex maxUploadsPerBus);
+
+/*!
+ @function iUSBUploadSchedulerSendData
+ Sends an in-memory image to a device once the scheduler admits it onto the device's bus. 
+ Blocks the calling thread until the upload has finished. Call it from one thread per device.
+ @param scheduler - The scheduler to go through.
+ @param device - The device to send the data to.
+ @param data - The data to send.
+ @param priority - Waiting uploads with a higher priority are admitted first. Among equal priorities, 
+ smaller uploads go first, so e.g. passing the number of stages a device has left, negated, finishes 
+ near-done devices first.
+ @param progressCallback - Optional. A callback function that progress will be sent to.
+ @result A boolean value, stating whether the data was sent.
+ */
+Boolean iUSBUploadSchedulerSendData(iUSBUploadSchedulerRef scheduler, iUSBRecoveryDeviceRef device, CFDataRef data, int priority, iUSBRecoveryDeviceTransferProgressCallback progressCallback);
+
+/*!
+ @function iUSBUploadSchedulerSendFile
+ Sends a file to a device once the scheduler admits it onto the device's bus. See 
+ iUSBUploadSchedulerSendData and iUSBRecoveryDeviceSendFile.
+ @param scheduler - The scheduler to go through.
+ @param device - The device to send the file to.
+ @param filePath - The file to send.
+ @param priority - See iUSBUploadSchedulerSendData.
+ @param progressCallback - Optional. A callback function that progress will be sent to.
+ @result A boolean value, stating whether the file was sent.
+ */
+Boolean iUSBUploadSchedulerSendFile(iUSBUploadSchedulerRef scheduler, iUSBRecoveryDeviceRef device, CFStringRef filePath, int priority, iUSBRecoveryDeviceTransferProgressCallback progressCallback);
+
+/*!
+ @function iUSBUploadSchedulerSendFileDescriptor
+ Sends the contents of an open file to a device once the scheduler admits it onto the device's bus. 
+ See iUSBUploadSchedulerSendData and iUSBRecoveryDeviceSendFileDescriptor.
+ @param scheduler - The scheduler to go through.
+ @param device - The device to send the file to.
+ @param file - A descriptor for the file, open for reading. It is not closed.
+ @param priority - See iUSBUploadSchedulerSendData.
+ @param progressCallback - Optional. A callback function that progress will be sent to.
+ @result A boolean value, stating whether the file was sent.
+ */
+Boolean iUSBUploadSchedulerSendFileDescriptor(iUSBUploadSchedulerRef scheduler, iUSBRecoveryDeviceRef device, int file, int priority, iUSBRecoveryDeviceTransferProgressCallback progressCallback);
+
+/*!
+ @function iUSBUploadSchedulerSendFileAsync
+ Queue a file to be sent with iUSBRecoveryDeviceSendFileAsync once the scheduler admits it onto the 
+ device's bus. Nothing blocks while it waits; the upload is started by whichever upload frees its slot.
+ @param scheduler - The scheduler to go through.
+ @param device - The device to send the file to. Must be scheduled with a run loop. It is retained until 
+ the upload completes.
+ @param filePath - The file to send.
+ @param priority - See iUSBUploadSchedulerSendData.
+ @param progressCallback - Optional. A callback function that progress will be sent to.
+ @param callback - Optional. Called once the upload has finished or failed, on the device's run loop, or 
+ on the thread that admitted it if it could not be started.
+ @param context - Optional. Passed back to callback.
+ @result A boolean value, stating whether the upload was queued. If it was, callback will be called exactly once.
+ */
+Boolean iUSBUploadSchedulerSendFileAsync(iUSBUploadSchedulerRef scheduler, iUSBRecoveryDeviceRef device, CFStringRef filePath, int priority, iUSBRecoveryDeviceTransferProgressCallback progressCallback, iUSBRecoveryDeviceCompletionCallback callback, void *context);
+
+/*!
+ @function iUSBUploadSchedulerGetBusThroughput
+ Returns the throughput the scheduler has measured on a bus, over all the uploads running on it.
+ @param scheduler - The scheduler to query.
+ @param bus - The bus number, the top byte of a device's location ID.
+ @result The throughput over the last window in bytes per second, or 0 if no window has been measured yet.
+ */
+Float64 iUSBUploadSchedulerGetBusThroughput(iUSBUploadSchedulerRef scheduler, UInt8 bus);
+
+/*!
+ @function iUSBUploadSchedulerGetBusLimit
+ Returns how many uploads the scheduler currently lets run at once on a bus.
+ @param scheduler - The scheduler to query.
+ @param bus - The bus number, the top byte of a device's location ID.
+ @result The current limit for the bus.
+ */
+CFIndex iUSBUploadSchedulerGetBusLimit(iUSBUploadSchedulerRef scheduler, UInt8 bus);
+
+/*!
+ @function iUSBUploadSchedulerRelease
+ Deallocate a scheduler. No uploads may be waiting on or running through it.
+ @param scheduler - The scheduler to deallocate
+ */
+void iUSBUploadSchedulerRelease(iUSBUploadSchedulerRef scheduler);
+
+#endif /* IUSBCOMM_SCHEDULER_H */
\ No newline at end of file
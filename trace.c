@@ -0,0 +1,652 @@
+/*
+ *  trace.c
+ *  iusbcomm
+ *
+ *  Created by John Heaton on 5/16/10.
+ *  Copyright 2010 Gojohnnyboi. All rights reserved.
+ *
+ */
+
+#include "trace.h"
+#include "helper.h"
+
+#include <time.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <mach/mach_time.h>
+
+#define kTraceVersion 2
+#define kTraceBufferRecords 1024
+#define kTraceBufferData (128 * 1024)
+
+struct __iUSBTraceFileHeader {
+	char magic[4];
+	uint32_t version;
+	uint32_t recordSize;
+	uint32_t reserved;
+};
+
+struct __iUSBTraceBuffer {
+	volatile CFIndex count;
+	CFIndex flushed;
+	size_t dataUsed;
+	size_t dataFlushed;
+	uint64_t threadID;
+	struct __iUSBTraceBuffer *next;
+	iUSBTraceRecord records[kTraceBufferRecords];
+	unsigned char data[kTraceBufferData];
+};
+
+struct __iUSBTraceReader {
+	FILE *file;
+	void *data;
+	size_t dataCapacity;
+	uint32_t dataLength;
+};
+
+struct __iUSBTraceReplayRecord {
+	iUSBTraceRecord record;
+	void *data;
+};
+
+struct __iUSBTraceReplayCursor {
+	uint64_t deviceID;
+	CFIndex next[3];
+};
+
+struct __iUSBTraceAsync {
+	iUSBTraceRecord record;
+	void *data;
+	IOAsyncCallback1 callback;
+	void *refCon;
+};
+
+static volatile Boolean traceEnabled = 0;
+static pthread_mutex_t traceLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t traceKeyOnce = PTHREAD_ONCE_INIT;
+static pthread_key_t traceKey;
+static FILE *traceFile = NULL;
+static struct __iUSBTraceBuffer *traceBuffers = NULL;
+static mach_timebase_info_data_t traceTimebase;
+
+static volatile Boolean traceReplaying = 0;
+static pthread_mutex_t replayLock = PTHREAD_MUTEX_INITIALIZER;
+static struct __iUSBTraceReplayRecord *replayRecords = NULL;
+static CFIndex replayCount = 0;
+static struct __iUSBTraceReplayCursor *replayCursors = NULL;
+static CFIndex replayCursorCount = 0;
+static Boolean replayRealTime = 0;
+
+HIDDEN void traceCreateKey(void);
+HIDDEN void traceThreadExited(void *buffer);
+HIDDEN void traceFlushBuffer(struct __iUSBTraceBuffer *buffer);
+HIDDEN uint64_t traceNow(void);
+HIDDEN void traceRecord(iUSBTraceRecord *record, const void *data, uint32_t dataLength);
+HIDDEN int traceCompareStart(const void *a, const void *b);
+HIDDEN void traceReplayFree(struct __iUSBTraceReplayRecord *records, CFIndex count);
+HIDDEN IOReturn traceReplayNext(uint64_t deviceID, uint8_t kind, void *buf, UInt32 capacity, UInt32 *lengthDone);
+HIDDEN IOReturn traceReplayTake(uint64_t deviceID, uint8_t kind, void *buf, UInt32 capacity, UInt32 *lengthDone, uint64_t *duration);
+HIDDEN IOReturn traceReplayDeliver(IOAsyncCallback1 callback, void *refCon, IOReturn result, UInt32 lengthDone, uint64_t duration, CFRunLoopRef runLoop, CFStringRef runLoopMode);
+HIDDEN void traceReplayFire(CFRunLoopTimerRef timer, void *info);
+HIDDEN struct __iUSBTraceAsync *traceAsyncCreate(uint64_t deviceID, uint8_t kind, IOAsyncCallback1 callback, void *refCon);
+HIDDEN void traceAsyncCompleted(void *refCon, IOReturn result, void *arg0);
+
+Boolean iUSBTraceStart(CFStringRef filePath) {
+	if(filePath == NULL)
+		return 0;
+	
+	char path[PATH_MAX];
+	if(!CFStringGetFileSystemRepresentation(filePath, path, sizeof(path)))
+		return 0;
+	
+	pthread_once(&traceKeyOnce, traceCreateKey);
+	
+	pthread_mutex_lock(&traceLock);
+	if(traceFile != NULL) {
+		pthread_mutex_unlock(&traceLock);
+		return 0;
+	}
+	
+	// anything left over from an earlier trace doesn't belong in this one, so it's passed over before the file exists
+	struct __iUSBTraceBuffer *buffer;
+	for(buffer = traceBuffers; buffer != NULL; buffer = buffer->next) {
+		traceFlushBuffer(buffer);
+	}
+	
+	traceFile = fopen(path, "wb");
+	if(traceFile == NULL) {
+		pthread_mutex_unlock(&traceLock);
+		return 0;
+	}
+	
+	struct __iUSBTraceFileHeader header = { { 'i', 'U', 'T', 'R' }, kTraceVersion, sizeof(iUSBTraceRecord), 0 };
+	fwrite(&header, sizeof(header), 1, traceFile);
+	
+	traceEnabled = 1;
+	pthread_mutex_unlock(&traceLock);
+	
+	return 1;
+}
+
+void iUSBTraceStop(void) {
+	pthread_mutex_lock(&traceLock);
+	traceEnabled = 0;
+	
+	if(traceFile != NULL) {
+		struct __iUSBTraceBuffer *buffer;
+		for(buffer = traceBuffers; buffer != NULL; buffer = buffer->next) {
+			traceFlushBuffer(buffer);
+		}
+		
+		fclose(traceFile);
+		traceFile = NULL;
+	}
+	pthread_mutex_unlock(&traceLock);
+}
+
+iUSBTraceReaderRef iUSBTraceReaderCreate(CFStringRef filePath) {
+	if(filePath == NULL)
+		return NULL;
+	
+	char path[PATH_MAX];
+	if(!CFStringGetFileSystemRepresentation(filePath, path, sizeof(path)))
+		return NULL;
+	
+	FILE *file = fopen(path, "rb");
+	if(file == NULL)
+		return NULL;
+	
+	struct __iUSBTraceFileHeader header;
+	if(fread(&header, sizeof(header), 1, file) != 1 || memcmp(header.magic, "iUTR", 4) != 0 || header.version != kTraceVersion || header.recordSize != sizeof(iUSBTraceRecord)) {
+		fclose(file);
+		return NULL;
+	}
+	
+	iUSBTraceReaderRef newReader = calloc(1, sizeof(struct __iUSBTraceReader));
+	newReader->file = file;
+	
+	return newReader;
+}
+
+Boolean iUSBTraceReaderNext(iUSBTraceReaderRef reader, iUSBTraceRecord *record) {
+	if(reader == NULL || record == NULL)
+		return 0;
+	
+	reader->dataLength = 0;
+	if(fread(record, sizeof(iUSBTraceRecord), 1, reader->file) != 1)
+		return 0;
+	
+	if(record->dataLength > reader->dataCapacity) {
+		void *data = realloc(reader->data, record->dataLength);
+		if(data == NULL)
+			return 0;
+		
+		reader->data = data;
+		reader->dataCapacity = record->dataLength;
+	}
+	
+	if(record->dataLength && fread(reader->data, record->dataLength, 1, reader->file) != 1)
+		return 0;
+	
+	reader->dataLength = record->dataLength;
+	
+	return 1;
+}
+
+const void *iUSBTraceReaderGetData(iUSBTraceReaderRef reader) {
+	if(reader == NULL || reader->dataLength == 0)
+		return NULL;
+	
+	return reader->data;
+}
+
+void iUSBTraceReaderRelease(iUSBTraceReaderRef reader) {
+	if(reader != NULL) {
+		fclose(reader->file);
+		if(reader->data) free(reader->data);
+		free(reader);
+	}
+}
+
+Boolean iUSBTraceReplayStart(CFStringRef filePath, Boolean realTime) {
+	iUSBTraceReaderRef reader = iUSBTraceReaderCreate(filePath);
+	if(reader == NULL)
+		return 0;
+	
+	struct __iUSBTraceReplayRecord *records = NULL;
+	CFIndex count = 0, capacity = 0;
+	iUSBTraceRecord record;
+	while(iUSBTraceReaderNext(reader, &record)) {
+		if(count == capacity) {
+			capacity = (capacity ? capacity * 2 : 256);
+			struct __iUSBTraceReplayRecord *grown = realloc(records, capacity * sizeof(struct __iUSBTraceReplayRecord));
+			if(grown == NULL) {
+				traceReplayFree(records, count);
+				iUSBTraceReaderRelease(reader);
+				return 0;
+			}
+			records = grown;
+		}
+		
+		records[count].record = record;
+		records[count].data = NULL;
+		if(record.dataLength) {
+			records[count].data = malloc(record.dataLength);
+			if(records[count].data) memcpy(records[count].data, iUSBTraceReaderGetData(reader), record.dataLength);
+			else records[count].record.dataLength = 0;
+		}
+		count++;
+	}
+	iUSBTraceReaderRelease(reader);
+	
+	// the file is grouped by thread, but transfers have to be answered in the order they were made
+	qsort(records, count, sizeof(struct __iUSBTraceReplayRecord), traceCompareStart);
+	
+	pthread_mutex_lock(&replayLock);
+	if(traceReplaying) {
+		pthread_mutex_unlock(&replayLock);
+		traceReplayFree(records, count);
+		return 0;
+	}
+	
+	replayRecords = records;
+	replayCount = count;
+	replayCursorCount = 0;
+	replayRealTime = realTime;
+	traceReplaying = 1;
+	pthread_mutex_unlock(&replayLock);
+	
+	return 1;
+}
+
+void iUSBTraceReplayStop(void) {
+	pthread_mutex_lock(&replayLock);
+	traceReplaying = 0;
+	traceReplayFree(replayRecords, replayCount);
+	replayRecords = NULL;
+	replayCount = 0;
+	if(replayCursors) free(replayCursors);
+	replayCursors = NULL;
+	replayCursorCount = 0;
+	pthread_mutex_unlock(&replayLock);
+}
+
+Boolean traceReplayActive(void) {
+	return traceReplaying;
+}
+
+IOReturn traceDeviceRequest(IOUSBDeviceInterface **deviceHandle, uint64_t deviceID, IOUSBDevRequest *request) {
+	if(traceReplaying) {
+		UInt32 lengthDone = 0;
+		IOReturn result = traceReplayNext(deviceID, kUSBTraceControl, ((request->bmRequestType & 0x80) ? request->pData : NULL), request->wLength, &lengthDone);
+		request->wLenDone = lengthDone;
+		return result;
+	}
+	
+	// devices made for a replay have no handles to fall back on once it stops
+	if(deviceHandle == NULL)
+		return kIOReturnNotOpen;
+	
+	if(!traceEnabled)
+		return (*deviceHandle)->DeviceRequest(deviceHandle, request);
+	
+	iUSBTraceRecord record;
+	record.start = traceNow();
+	IOReturn result = (*deviceHandle)->DeviceRequest(deviceHandle, request);
+	record.duration = traceNow() - record.start;
+	
+	record.deviceID = deviceID;
+	record.kind = kUSBTraceControl;
+	record.bmRequestType = request->bmRequestType;
+	record.bRequest = request->bRequest;
+	record.wValue = request->wValue;
+	record.wIndex = request->wIndex;
+	record.pipeRef = 0;
+	record.length = request->wLength;
+	record.lengthDone = request->wLenDone;
+	record.result = result;
+	traceRecord(&record, request->pData, ((request->bmRequestType & 0x80) && result == kIOReturnSuccess ? request->wLenDone : 0));
+	
+	return result;
+}
+
+IOReturn traceReadPipe(IOUSBInterfaceInterface182 **interfaceHandle, uint64_t deviceID, UInt8 pipeRef, void *buf, UInt32 *size, UInt32 noDataTimeout, UInt32 completionTimeout) {
+	if(traceReplaying)
+		return traceReplayNext(deviceID, kUSBTraceBulkIn, buf, *size, size);
+	
+	if(interfaceHandle == NULL)
+		return kIOReturnNotOpen;
+	
+	if(!traceEnabled)
+		return (*interfaceHandle)->ReadPipeTO(interfaceHandle, pipeRef, buf, size, noDataTimeout, completionTimeout);
+	
+	iUSBTraceRecord record;
+	record.length = *size;
+	record.start = traceNow();
+	IOReturn result = (*interfaceHandle)->ReadPipeTO(interfaceHandle, pipeRef, buf, size, noDataTimeout, completionTimeout);
+	record.duration = traceNow() - record.start;
+	
+	record.deviceID = deviceID;
+	record.kind = kUSBTraceBulkIn;
+	record.bmRequestType = record.bRequest = 0;
+	record.wValue = record.wIndex = 0;
+	record.pipeRef = pipeRef;
+	record.lengthDone = (result == kIOReturnSuccess ? *size : 0);
+	record.result = result;
+	traceRecord(&record, buf, record.lengthDone);
+	
+	return result;
+}
+
+IOReturn traceWritePipe(IOUSBInterfaceInterface182 **interfaceHandle, uint64_t deviceID, UInt8 pipeRef, void *buf, UInt32 size, UInt32 noDataTimeout, UInt32 completionTimeout) {
+	if(traceReplaying) {
+		UInt32 lengthDone = 0;
+		return traceReplayNext(deviceID, kUSBTraceBulkOut, NULL, size, &lengthDone);
+	}
+	
+	if(interfaceHandle == NULL)
+		return kIOReturnNotOpen;
+	
+	if(!traceEnabled)
+		return (*interfaceHandle)->WritePipeTO(interfaceHandle, pipeRef, buf, size, noDataTimeout, completionTimeout);
+	
+	iUSBTraceRecord record;
+	record.start = traceNow();
+	IOReturn result = (*interfaceHandle)->WritePipeTO(interfaceHandle, pipeRef, buf, size, noDataTimeout, completionTimeout);
+	record.duration = traceNow() - record.start;
+	
+	record.deviceID = deviceID;
+	record.kind = kUSBTraceBulkOut;
+	record.bmRequestType = record.bRequest = 0;
+	record.wValue = record.wIndex = 0;
+	record.pipeRef = pipeRef;
+	record.length = size;
+	record.lengthDone = (result == kIOReturnSuccess ? size : 0);
+	record.result = result;
+	traceRecord(&record, NULL, 0);
+	
+	return result;
+}
+
+IOReturn traceDeviceRequestAsync(IOUSBDeviceInterface **deviceHandle, uint64_t deviceID, IOUSBDevRequest *request, IOAsyncCallback1 callback, void *refCon, CFRunLoopRef runLoop, CFStringRef runLoopMode) {
+	if(traceReplaying) {
+		UInt32 lengthDone = 0;
+		uint64_t duration = 0;
+		IOReturn result = traceReplayTake(deviceID, kUSBTraceControl, ((request->bmRequestType & 0x80) ? request->pData : NULL), request->wLength, &lengthDone, &duration);
+		request->wLenDone = lengthDone;
+		return traceReplayDeliver(callback, refCon, result, lengthDone, duration, runLoop, runLoopMode);
+	}
+	
+	if(deviceHandle == NULL)
+		return kIOReturnNotOpen;
+	
+	if(!traceEnabled)
+		return (*deviceHandle)->DeviceRequestAsync(deviceHandle, request, callback, refCon);
+	
+	struct __iUSBTraceAsync *async = traceAsyncCreate(deviceID, kUSBTraceControl, callback, refCon);
+	if(async == NULL)
+		return kIOReturnNoMemory;
+	
+	async->record.bmRequestType = request->bmRequestType;
+	async->record.bRequest = request->bRequest;
+	async->record.wValue = request->wValue;
+	async->record.wIndex = request->wIndex;
+	async->record.length = request->wLength;
+	async->data = ((request->bmRequestType & 0x80) ? request->pData : NULL);
+	
+	IOReturn result = (*deviceHandle)->DeviceRequestAsync(deviceHandle, request, traceAsyncCompleted, async);
+	if(result != kIOReturnSuccess) free(async);
+	
+	return result;
+}
+
+IOReturn traceReadPipeAsync(IOUSBInterfaceInterface182 **interfaceHandle, uint64_t deviceID, UInt8 pipeRef, void *buf, UInt32 size, UInt32 noDataTimeout, UInt32 completionTimeout, IOAsyncCallback1 callback, void *refCon, CFRunLoopRef runLoop, CFStringRef runLoopMode) {
+	if(traceReplaying) {
+		UInt32 lengthDone = 0;
+		uint64_t duration = 0;
+		IOReturn result = traceReplayTake(deviceID, kUSBTraceBulkIn, buf, size, &lengthDone, &duration);
+		return traceReplayDeliver(callback, refCon, result, lengthDone, duration, runLoop, runLoopMode);
+	}
+	
+	if(interfaceHandle == NULL)
+		return kIOReturnNotOpen;
+	
+	if(!traceEnabled)
+		return (*interfaceHandle)->ReadPipeAsyncTO(interfaceHandle, pipeRef, buf, size, noDataTimeout, completionTimeout, callback, refCon);
+	
+	struct __iUSBTraceAsync *async = traceAsyncCreate(deviceID, kUSBTraceBulkIn, callback, refCon);
+	if(async == NULL)
+		return kIOReturnNoMemory;
+	
+	async->record.pipeRef = pipeRef;
+	async->record.length = size;
+	async->data = buf;
+	
+	IOReturn result = (*interfaceHandle)->ReadPipeAsyncTO(interfaceHandle, pipeRef, buf, size, noDataTimeout, completionTimeout, traceAsyncCompleted, async);
+	if(result != kIOReturnSuccess) free(async);
+	
+	return result;
+}
+
+HIDDEN void traceCreateKey(void) {
+	pthread_key_create(&traceKey, traceThreadExited);
+	mach_timebase_info(&traceTimebase);
+}
+
+HIDDEN void traceThreadExited(void *buffer) {
+	pthread_mutex_lock(&traceLock);
+	traceFlushBuffer(buffer);
+	
+	struct __iUSBTraceBuffer **link = &traceBuffers;
+	while(*link != buffer) link = &(*link)->next;
+	*link = ((struct __iUSBTraceBuffer *)buffer)->next;
+	pthread_mutex_unlock(&traceLock);
+	
+	free(buffer);
+}
+
+// called with the trace lock held; with no trace file open the records are just passed over
+HIDDEN void traceFlushBuffer(struct __iUSBTraceBuffer *buffer) {
+	CFIndex count = buffer->count;
+	atomic_thread_fence(memory_order_seq_cst);
+	
+	for(; buffer->flushed < count; buffer->flushed++) {
+		iUSBTraceRecord *record = &buffer->records[buffer->flushed];
+		if(traceFile != NULL) {
+			fwrite(record, sizeof(iUSBTraceRecord), 1, traceFile);
+			if(record->dataLength) fwrite(&buffer->data[buffer->dataFlushed], record->dataLength, 1, traceFile);
+		}
+		buffer->dataFlushed += record->dataLength;
+	}
+}
+
+HIDDEN uint64_t traceNow(void) {
+	return (mach_absolute_time() * traceTimebase.numer) / traceTimebase.denom;
+}
+
+HIDDEN void traceRecord(iUSBTraceRecord *record, const void *data, uint32_t dataLength) {
+	struct __iUSBTraceBuffer *buffer = pthread_getspecific(traceKey);
+	if(buffer == NULL) {
+		buffer = calloc(1, sizeof(struct __iUSBTraceBuffer));
+		buffer->threadID = pthread_mach_thread_np(pthread_self());
+		
+		pthread_mutex_lock(&traceLock);
+		buffer->next = traceBuffers;
+		traceBuffers = buffer;
+		pthread_mutex_unlock(&traceLock);
+		
+		pthread_setspecific(traceKey, buffer);
+	}
+	
+	if(data == NULL) dataLength = 0;
+	if(dataLength > kTraceBufferData) dataLength = kTraceBufferData;
+	
+	// only the owning thread appends, so recording itself takes no lock; a full buffer is written out and reused
+	if(buffer->count == kTraceBufferRecords || buffer->dataUsed + dataLength > kTraceBufferData) {
+		pthread_mutex_lock(&traceLock);
+		traceFlushBuffer(buffer);
+		buffer->count = buffer->flushed = 0;
+		buffer->dataUsed = buffer->dataFlushed = 0;
+		pthread_mutex_unlock(&traceLock);
+	}
+	
+	record->threadID = buffer->threadID;
+	record->dataLength = dataLength;
+	if(dataLength) memcpy(&buffer->data[buffer->dataUsed], data, dataLength);
+	buffer->dataUsed += dataLength;
+	buffer->records[buffer->count] = *record;
+	
+	// the record and its data have to be visible before the count that covers them, for flushes from iUSBTraceStop
+	atomic_thread_fence(memory_order_seq_cst);
+	buffer->count++;
+}
+
+HIDDEN int traceCompareStart(const void *a, const void *b) {
+	uint64_t startA = ((const struct __iUSBTraceReplayRecord *)a)->record.start;
+	uint64_t startB = ((const struct __iUSBTraceReplayRecord *)b)->record.start;
+	
+	return (startA < startB ? -1 : (startA > startB ? 1 : 0));
+}
+
+HIDDEN void traceReplayFree(struct __iUSBTraceReplayRecord *records, CFIndex count) {
+	CFIndex i;
+	for(i = 0; i < count; ++i) {
+		if(records[i].data) free(records[i].data);
+	}
+	
+	if(records) free(records);
+}
+
+HIDDEN IOReturn traceReplayNext(uint64_t deviceID, uint8_t kind, void *buf, UInt32 capacity, UInt32 *lengthDone) {
+	uint64_t duration = 0;
+	IOReturn result = traceReplayTake(deviceID, kind, buf, capacity, lengthDone, &duration);
+	
+	if(duration) {
+		struct timespec delay;
+		delay.tv_sec = duration / 1000000000;
+		delay.tv_nsec = duration % 1000000000;
+		nanosleep(&delay, NULL);
+	}
+	
+	return result;
+}
+
+// duration is how long the transfer should appear to take: the recorded time in real time mode, otherwise 0
+HIDDEN IOReturn traceReplayTake(uint64_t deviceID, uint8_t kind, void *buf, UInt32 capacity, UInt32 *lengthDone, uint64_t *duration) {
+	*lengthDone = 0;
+	*duration = 0;
+	
+	pthread_mutex_lock(&replayLock);
+	if(!traceReplaying) {
+		pthread_mutex_unlock(&replayLock);
+		return kIOReturnNoDevice;
+	}
+	
+	// each device keeps its own place for each kind of transfer, so neither another device nor a stray
+	// status poll can throw off the bulk reads
+	CFIndex c;
+	for(c = 0; c < replayCursorCount && replayCursors[c].deviceID != deviceID; ++c);
+	if(c == replayCursorCount) {
+		struct __iUSBTraceReplayCursor *grown = realloc(replayCursors, (replayCursorCount + 1) * sizeof(struct __iUSBTraceReplayCursor));
+		if(grown == NULL) {
+			pthread_mutex_unlock(&replayLock);
+			return kIOReturnNoMemory;
+		}
+		
+		replayCursors = grown;
+		memset(&replayCursors[c], 0, sizeof(struct __iUSBTraceReplayCursor));
+		replayCursors[c].deviceID = deviceID;
+		replayCursorCount++;
+	}
+	
+	CFIndex i = replayCursors[c].next[kind];
+	while(i < replayCount && (replayRecords[i].record.kind != kind || replayRecords[i].record.deviceID != deviceID)) i++;
+	
+	if(i == replayCount) {
+		replayCursors[c].next[kind] = i;
+		pthread_mutex_unlock(&replayLock);
+		return kIOReturnNoDevice;
+	}
+	
+	replayCursors[c].next[kind] = i + 1;
+	iUSBTraceRecord record = replayRecords[i].record;
+	
+	*lengthDone = (record.lengthDone < capacity ? record.lengthDone : capacity);
+	if(buf != NULL && record.dataLength) {
+		memcpy(buf, replayRecords[i].data, (record.dataLength < *lengthDone ? record.dataLength : *lengthDone));
+	}
+	
+	if(replayRealTime) *duration = record.duration;
+	pthread_mutex_unlock(&replayLock);
+	
+	return record.result;
+}
+
+// replayed completions come back through the run loop like IOKit's, never from inside the call that started them
+HIDDEN IOReturn traceReplayDeliver(IOAsyncCallback1 callback, void *refCon, IOReturn result, UInt32 lengthDone, uint64_t duration, CFRunLoopRef runLoop, CFStringRef runLoopMode) {
+	if(runLoop == NULL)
+		return kIOReturnNotReady;
+	
+	struct __iUSBTraceAsync *async = calloc(1, sizeof(struct __iUSBTraceAsync));
+	if(async == NULL)
+		return kIOReturnNoMemory;
+	
+	async->callback = callback;
+	async->refCon = refCon;
+	async->record.result = result;
+	async->record.lengthDone = lengthDone;
+	
+	CFRunLoopTimerContext context = { 0, async, NULL, NULL, NULL };
+	CFRunLoopTimerRef timer = CFRunLoopTimerCreate(kCFAllocatorDefault, CFAbsoluteTimeGetCurrent() + (duration / 1000000000.0), 0, 0, 0, traceReplayFire, &context);
+	if(timer == NULL) {
+		free(async);
+		return kIOReturnNoMemory;
+	}
+	
+	CFRunLoopAddTimer(runLoop, timer, runLoopMode);
+	CFRelease(timer);
+	
+	return kIOReturnSuccess;
+}
+
+HIDDEN void traceReplayFire(CFRunLoopTimerRef timer, void *info) {
+	struct __iUSBTraceAsync *async = info;
+	IOAsyncCallback1 callback = async->callback;
+	void *refCon = async->refCon;
+	IOReturn result = async->record.result;
+	UInt32 lengthDone = async->record.lengthDone;
+	free(async);
+	
+	callback(refCon, result, (void *)(uintptr_t)lengthDone);
+}
+
+HIDDEN struct __iUSBTraceAsync *traceAsyncCreate(uint64_t deviceID, uint8_t kind, IOAsyncCallback1 callback, void *refCon) {
+	struct __iUSBTraceAsync *async = calloc(1, sizeof(struct __iUSBTraceAsync));
+	if(async == NULL)
+		return NULL;
+	
+	async->record.deviceID = deviceID;
+	async->record.kind = kind;
+	async->callback = callback;
+	async->refCon = refCon;
+	async->record.start = traceNow();
+	
+	return async;
+}
+
+// an async transfer is recorded by the thread its completion arrives on, once it's done
+HIDDEN void traceAsyncCompleted(void *refCon, IOReturn result, void *arg0) {
+	struct __iUSBTraceAsync *async = refCon;
+	async->record.duration = traceNow() - async->record.start;
+	async->record.lengthDone = (UInt32)(uintptr_t)arg0;
+	if(async->record.kind == kUSBTraceBulkIn && result != kIOReturnSuccess) async->record.lengthDone = 0;
+	async->record.result = result;
+	if(traceEnabled) traceRecord(&async->record, async->data, (result == kIOReturnSuccess ? async->record.lengthDone : 0));
+	
+	IOAsyncCallback1 callback = async->callback;
+	void *callbackRefCon = async->refCon;
+	free(async);
+	
+	callback(callbackRefCon, result, arg0);
+}
\ No newline at end of file
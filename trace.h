@@ -0,0 +1,139 @@
+/*
+ *  trace.h
+ *  iusbcomm
+ *
+ *  Created by John Heaton on 5/16/10.
+ *  Copyright 2010 Gojohnnyboi. All rights reserved.
+ *
+ */
+
+#ifndef IUSBCOMM_TRACE_H
+#define IUSBCOMM_TRACE_H
+
+#include <CoreFoundation/CoreFoundation.h>
+
+typedef struct __iUSBTraceReader *iUSBTraceReaderRef;
+
+/*!
+ @enum iUSBTraceKind
+ @field kUSBTraceControl - a request on the control pipe
+ @field kUSBTraceBulkIn - a read from a bulk pipe
+ @field kUSBTraceBulkOut - a write to a bulk pipe
+ */
+enum iUSBTraceKind {
+	kUSBTraceControl = 0,
+	kUSBTraceBulkIn = 1,
+	kUSBTraceBulkOut = 2
+};
+
+/*!
+ @struct iUSBTraceRecord
+ @field deviceID - The IORegistry entry ID of the device the transfer went to
+ @field threadID - The mach thread that made the transfer
+ @field start - When the transfer started, in nanoseconds of host uptime
+ @field duration - How long the transfer took, in nanoseconds
+ @field length - The number of bytes asked for
+ @field lengthDone - The number of bytes actually moved
+ @field result - The IOReturn the transfer finished with
+ @field wValue - The setup packet's wValue, for control transfers
+ @field wIndex - The setup packet's wIndex, for control transfers
+ @field kind - See @enum iUSBTraceKind
+ @field bmRequestType - The setup packet's bmRequestType, for control transfers
+ @field bRequest - The setup packet's bRequest, for control transfers
+ @field pipeRef - The pipe used, for bulk transfers
+ @field dataLength - The number of bytes the device sent back that were kept with the record. Only 
+ transfers from the device keep their data; it follows the record in the file.
+ */
+typedef struct {
+	uint64_t deviceID;
+	uint64_t threadID;
+	uint64_t start;
+	uint64_t duration;
+	uint32_t length;
+	uint32_t lengthDone;
+	int32_t result;
+	uint16_t wValue;
+	uint16_t wIndex;
+	uint8_t kind;
+	uint8_t bmRequestType;
+	uint8_t bRequest;
+	uint8_t pipeRef;
+	uint32_t dataLength;
+} iUSBTraceRecord;
+
+/*!
+ @function iUSBTraceStart
+ Start recording every USB transfer made through this library to a file. Tracing is off until this 
+ is called, and costs one branch per transfer while it is off. Each thread records into a buffer of its 
+ own without taking a lock; buffers are written to the file as they fill up. Asynchronous transfers are 
+ recorded by the thread their completion arrives on.
+ @param filePath - The file to write the trace to. It is replaced if it exists.
+ @result A boolean value, stating whether the file could be created.
+ */
+Boolean iUSBTraceStart(CFStringRef filePath);
+
+/*!
+ @function iUSBTraceStop
+ Stop recording, write out everything still buffered and close the trace file. Call it once 
+ transfers on other threads have finished, or their last few records may be missing.
+ */
+void iUSBTraceStop(void);
+
+/*!
+ @function iUSBTraceReaderCreate
+ Open a trace file written by iUSBTraceStart for reading.
+ @param filePath - The trace file.
+ @result A new reader object which the caller is responsible for releasing, or NULL if the 
+ file is missing or not a trace.
+ */
+iUSBTraceReaderRef iUSBTraceReaderCreate(CFStringRef filePath);
+
+/*!
+ @function iUSBTraceReaderNext
+ Read the next record from a trace. Records come out grouped by thread in the order their buffers 
+ were written, so sort on the start field for a single timeline.
+ @param reader - The reader to read from.
+ @param record - Filled in with the next record.
+ @result A boolean value, stating whether a record was read. 0 at the end of the trace.
+ */
+Boolean iUSBTraceReaderNext(iUSBTraceReaderRef reader, iUSBTraceRecord *record);
+
+/*!
+ @function iUSBTraceReaderGetData
+ Get the data the device sent back for the record last read by iUSBTraceReaderNext.
+ @param reader - The reader to get the data from.
+ @result The record's dataLength bytes of data, or NULL if it has none. It belongs to the reader and 
+ is only valid until the next call to iUSBTraceReaderNext.
+ */
+const void *iUSBTraceReaderGetData(iUSBTraceReaderRef reader);
+
+/*!
+ @function iUSBTraceReaderRelease
+ Close the trace file and deallocate the reader.
+ @param reader - The reader to deallocate.
+ */
+void iUSBTraceReaderRelease(iUSBTraceReaderRef reader);
+
+/*!
+ @function iUSBTraceReplayStart
+ Answer every USB transfer made through this library from a trace file instead of the device, so a 
+ slow run can be reproduced and profiled away from where it was recorded. Each transfer takes the 
+ next unused record of its kind for its device in start order, and gets back that record's result, 
+ length and the data the device sent. Asynchronous transfers are replayed too, completing on the 
+ device's run loop. Devices opened through IOKit have their transfers replayed by registry entry ID; 
+ iUSBRecoveryDeviceCreateReplay makes one for a recorded device without the hardware.
+ @param filePath - A trace file written by iUSBTraceStart.
+ @param realTime - If 1, each transfer takes as long as it did when it was recorded. If 0, they 
+ return at once.
+ @result A boolean value, stating whether the trace could be read and no replay was already running.
+ */
+Boolean iUSBTraceReplayStart(CFStringRef filePath, Boolean realTime);
+
+/*!
+ @function iUSBTraceReplayStop
+ Stop replaying and send transfers to the device again. Transfers made once the trace has run out 
+ fail with kIOReturnNoDevice until this is called.
+ */
+void iUSBTraceReplayStop(void);
+
+#endif /* IUSBCOMM_TRACE_H */
\ No newline at end of file